@@ -2,8 +2,14 @@
 /* Copyright (C) 2022 - 2023 Nathanael Specht */
 
 #include "demo.h"
+#include <cstring>
 
 int main (int argc, char** argv) {
+	// Check that offline audio renders are repeatable, with no window.
+	if (argc > 1 && std::strcmp(argv[1], "--render-check") == 0) {
+		return demo::render_check();
+	}
+	
 	demo::Core game;
 	game.reset();
 	game.loop();
@@ -3,6 +3,7 @@
 
 #include "demo.h"
 #include <iostream>
+#include <cstring>
 
 demo::Core::Core () {}
 
@@ -23,15 +24,33 @@ void demo::Core::reset () {
 	}
 	
 	{
-		const char* file;
+		// Images and clips decode on worker threads while a loading bar draws.
+		// The music stream only opens its file here, so it loads directly.
+		ng::Loader loader;
 		try {
 			ng::Color color_key;
 			color_key.set(0, 0, 0);
-			this->font_img.load(&this->graphics, file="game-data/text.bmp", &color_key);
-			this->crazy_music.load(&this->audio, file="game-data/Corncob.wav");
+			loader.open(&this->graphics, 2);
+			loader.load(&this->font_img, "game-data/text.bmp", color_key);
+			this->crazy_music.load(&this->audio, "game-data/Corncob.wav");
+			
+			ng::Color black, white;
+			black.set(0, 0, 0);
+			white.set(255, 255, 255);
+			while (!loader.finish()) {
+				ng::Box2 bar(0.0, 0.0, this->graphics.rx * 0.5 * loader.progress(), 8.0);
+				this->graphics.set_color(black);
+				this->graphics.clear();
+				this->graphics.set_color(white);
+				this->graphics.draw_box(bar, ng::DrawFill);
+				this->graphics.draw();
+				SDL_Delay(1);
+			}
+			loader.check();
+			loader.close();
 			
 		} catch (const std::exception& ex) {
-			std::cout << "error loading \"" << file << "\":\n"
+			std::cout << "error loading data:\n"
 				<< ex.what();
 			exit(EXIT_FAILURE);
 		}
@@ -55,6 +74,9 @@ void demo::Core::reset () {
 	}
 	
 	this->screen.set_mode(demo::TitleMode);
+	
+	// Menus only change on events, so keep the window and redraw what changed.
+	this->graphics.set_retained(true);
 }
 
 void demo::Core::loop () {
@@ -77,9 +99,11 @@ void demo::Core::loop () {
 		}
 		
 		try {
-			this->graphics.set_color(&black);
-			this->graphics.clear();
-			this->screen.draw(this);
+			if (this->graphics.dirty()) {
+				this->graphics.set_color(&black);
+				this->graphics.clear();
+				this->screen.draw(this);
+			}
 			this->graphics.draw();
 		}
 		catch (const std::exception& ex) {
@@ -112,4 +136,44 @@ void demo::Core::quit () {
 	ng::quit();
 }
 
+// Render the music offline twice with the same ticks, and compare output
+// byte for byte. Returns EXIT_SUCCESS if both renders are the same.
+int demo::render_check () {
+	std::vector<float> outputs[2];
+	for (int r=0; r < 2; r++) {
+		ng::Audio audio;
+		ng::Stream music;
+		ng::Channel channel;
+		try {
+			audio.open(ng::AudioOffline);
+			music.load(&audio, "game-data/Corncob.wav");
+			channel.volume = 0.75;
+			channel.play_sound(&music, ng::SoundLoop);
+			// 10 seconds of uneven ticks, like a real frame rate.
+			for (int tick=0; tick < 600; tick++) {
+				audio.clear(16 + tick % 3);
+				audio.mix_channel(&channel);
+				audio.play();
+			}
+		} catch (const std::exception& ex) {
+			std::cout << "error rendering audio:\n"
+				<< ex.what();
+			return EXIT_FAILURE;
+		}
+		music.close();
+		audio.close();
+		outputs[r].swap(audio.output);
+	}
+	
+	bool same = outputs[0].size() == outputs[1].size() &&
+		std::memcmp(outputs[0].data(), outputs[1].data(),
+			outputs[0].size() * sizeof(float)) == 0;
+	if (!same) {
+		std::cout << "offline renders differ\n";
+		return EXIT_FAILURE;
+	}
+	std::cout << "offline renders match, " << outputs[0].size() << " samples\n";
+	return EXIT_SUCCESS;
+}
+
 
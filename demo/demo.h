@@ -79,7 +79,7 @@ namespace demo {
 		ng::Tileset font;
 		ng::Image font_img;
 		
-		ng::Clip crazy_music;
+		ng::Stream crazy_music;
 		ng::Channel music_channel;
 		ng::Channel sound_channel;
 		
@@ -93,6 +93,10 @@ namespace demo {
 		void quit ();
 	};
 	
+	// Render the music offline twice with the same ticks, and compare output
+	// byte for byte. Returns EXIT_SUCCESS if both renders are the same.
+	int render_check ();
+	
 } // demo
 
 #endif
@@ -32,6 +32,7 @@ int demo::Menu::event (Core* core) {
 		
 		if (k == SDL_SCANCODE_ESCAPE) {
 			this->draws = !this->draws;
+			this->canvas.damage();
 			core->event.consume();
 			return ng::None;
 		}
@@ -96,6 +97,8 @@ void demo::Screen::reset (Core* core) {
 
 void demo::Screen::set_mode (int mode) {
 	this->mode = mode;
+	// Menus show or hide.
+	this->canvas.damage();
 	
 	switch (mode) {
 		case demo::TitleMode: {
@@ -9,6 +9,7 @@
 #include "nggraphics.h"
 #include "nggui.h"
 #include "ngaudio.h"
+#include "ngload.h"
 #include "ngevent.h"
 #include "ngtime.h"
 // Use <string> and <sstream> for string.
@@ -4,12 +4,238 @@
 #include "ngaudio.h"
 #include "ngmath.h"
 
-ng::Clip::Clip () {}
+// Baked clips are mapped with the platform's own file mapping.
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-ng::Clip::~Clip () {}
+// Vector kernels are compiled with per-function target attributes, so the
+// build needs no -mavx2, and are only called when SDL reports the cpu has them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NG_MIX_X86
+#include <immintrin.h>
+#endif
 
-// Load .wav file into buffer, with same spec as audio device.
-void ng::Clip::load (Audio* a, const char* file) {
+// Scalar kernels. Always available, and used for the tail of vector kernels.
+static void mix_add_scalar (float* dest, const float* src, size_t n) {
+	for (size_t i=0; i < n; i++) {
+		dest[i] += src[i];
+	}
+}
+
+static void mix_add_gain_scalar (float* dest, const float* src, float gain, size_t n) {
+	for (size_t i=0; i < n; i++) {
+		dest[i] += src[i] * gain;
+	}
+}
+
+static void mix_gain_scalar (float* dest, float gain, size_t n) {
+	for (size_t i=0; i < n; i++) {
+		dest[i] *= gain;
+	}
+}
+
+static void mix_clamp_scalar (float* dest, float min, float max, size_t n) {
+	for (size_t i=0; i < n; i++) {
+		dest[i] = ng::clamp(dest[i], min, max);
+	}
+}
+
+#ifdef NG_MIX_X86
+__attribute__((target("sse2")))
+static void mix_add_sse2 (float* dest, const float* src, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(dest+i, _mm_add_ps(_mm_loadu_ps(dest+i), _mm_loadu_ps(src+i)));
+	}
+	mix_add_scalar(dest+i, src+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static void mix_add_gain_sse2 (float* dest, const float* src, float gain, size_t n) {
+	__m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(src+i), g);
+		_mm_storeu_ps(dest+i, _mm_add_ps(_mm_loadu_ps(dest+i), x));
+	}
+	mix_add_gain_scalar(dest+i, src+i, gain, n-i);
+}
+
+__attribute__((target("sse2")))
+static void mix_gain_sse2 (float* dest, float gain, size_t n) {
+	__m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(dest+i, _mm_mul_ps(_mm_loadu_ps(dest+i), g));
+	}
+	mix_gain_scalar(dest+i, gain, n-i);
+}
+
+__attribute__((target("sse2")))
+static void mix_clamp_sse2 (float* dest, float min, float max, size_t n) {
+	__m128 lo = _mm_set1_ps(min);
+	__m128 hi = _mm_set1_ps(max);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(dest+i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(dest+i), lo), hi));
+	}
+	mix_clamp_scalar(dest+i, min, max, n-i);
+}
+
+__attribute__((target("avx2")))
+static void mix_add_avx2 (float* dest, const float* src, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(dest+i, _mm256_add_ps(_mm256_loadu_ps(dest+i),
+			_mm256_loadu_ps(src+i)));
+	}
+	mix_add_scalar(dest+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static void mix_add_gain_avx2 (float* dest, const float* src, float gain, size_t n) {
+	__m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		// Separate multiply and add, not fma, so results match sse2 and scalar.
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(src+i), g);
+		_mm256_storeu_ps(dest+i, _mm256_add_ps(_mm256_loadu_ps(dest+i), x));
+	}
+	mix_add_gain_scalar(dest+i, src+i, gain, n-i);
+}
+
+__attribute__((target("avx2")))
+static void mix_gain_avx2 (float* dest, float gain, size_t n) {
+	__m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(dest+i, _mm256_mul_ps(_mm256_loadu_ps(dest+i), g));
+	}
+	mix_gain_scalar(dest+i, gain, n-i);
+}
+
+__attribute__((target("avx2")))
+static void mix_clamp_avx2 (float* dest, float min, float max, size_t n) {
+	__m256 lo = _mm256_set1_ps(min);
+	__m256 hi = _mm256_set1_ps(max);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(dest+i, _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(dest+i), lo), hi));
+	}
+	mix_clamp_scalar(dest+i, min, max, n-i);
+}
+#endif // NG_MIX_X86
+
+// Table of kernels for this cpu.
+struct MixKernels {
+	void (*add) (float*, const float*, size_t);
+	void (*add_gain) (float*, const float*, float, size_t);
+	void (*gain) (float*, float, size_t);
+	void (*clamp) (float*, float, float, size_t);
+};
+
+static MixKernels mix_kernels_detect () {
+	MixKernels k;
+	k.add = mix_add_scalar;
+	k.add_gain = mix_add_gain_scalar;
+	k.gain = mix_gain_scalar;
+	k.clamp = mix_clamp_scalar;
+#ifdef NG_MIX_X86
+	if (SDL_HasAVX2()) {
+		k.add = mix_add_avx2;
+		k.add_gain = mix_add_gain_avx2;
+		k.gain = mix_gain_avx2;
+		k.clamp = mix_clamp_avx2;
+	} else if (SDL_HasSSE2()) {
+		k.add = mix_add_sse2;
+		k.add_gain = mix_add_gain_sse2;
+		k.gain = mix_gain_sse2;
+		k.clamp = mix_clamp_sse2;
+	}
+#endif
+	return k;
+}
+
+// Detected on first use. Static init is thread-safe, so any thread may mix first.
+static const MixKernels& mix_kernels () {
+	static const MixKernels k = mix_kernels_detect();
+	return k;
+}
+
+// dest += src
+void ng::mix_add (float* dest, const float* src, size_t n) {
+	mix_kernels().add(dest, src, n);
+}
+
+// dest += src * gain
+void ng::mix_add_gain (float* dest, const float* src, float gain, size_t n) {
+	mix_kernels().add_gain(dest, src, gain, n);
+}
+
+// dest *= gain
+void ng::mix_gain (float* dest, float gain, size_t n) {
+	mix_kernels().gain(dest, gain, n);
+}
+
+// dest = clamp(dest, min, max)
+void ng::mix_clamp (float* dest, float min, float max, size_t n) {
+	mix_kernels().clamp(dest, min, max, n);
+}
+
+ng::Clip::Clip () {
+	SDL_zero(this->spec);
+	this->data = NULL;
+	this->frames = 0;
+	this->bytes = 0;
+	this->load_ms = 0.0;
+	this->mapped = NULL;
+	this->mapped_bytes = 0;
+}
+
+ng::Clip::~Clip () {
+	this->unmap();
+}
+
+// Copy samples into this clip's own buffer, even from a mapped clip.
+ng::Clip::Clip (const Clip& clip) {
+	this->data = NULL;
+	this->mapped = NULL;
+	this->mapped_bytes = 0;
+	*this = clip;
+}
+
+ng::Clip& ng::Clip::operator= (const Clip& clip) {
+	if (this == &clip) {
+		return *this;
+	}
+	this->unmap();
+	this->spec = clip.spec;
+	if (clip.data != NULL) {
+		this->buffer.assign(clip.data, clip.data + clip.bytes);
+		this->data = this->buffer.data();
+	} else {
+		this->buffer.clear();
+		this->data = NULL;
+	}
+	this->frames = clip.frames;
+	this->bytes = clip.bytes;
+	this->load_ms = clip.load_ms;
+	return *this;
+}
+
+// Load .wav file into buffer, with its own rate and channels.
+// Decodes into locals first, so a failed load leaves the clip as it was.
+void ng::Clip::load (const char* file) {
+	uint64_t start = SDL_GetPerformanceCounter();
+	
 	// load audio file
 	SDL_AudioSpec spec;
 	uint8_t* file_buffer;
@@ -18,158 +244,1689 @@ void ng::Clip::load (Audio* a, const char* file) {
 		throw std::runtime_error(SDL_GetError());
 	}
 	
-	// Use audio stream to convert loaded audio to desired format
+	// Keep rate, and mono or stereo. Keep 16-bit samples as int16, and store
+	// anything else as float32. The mixer converts while it mixes.
+	SDL_AudioSpec clip_spec = spec;
+	if (clip_spec.channels > 2) {
+		clip_spec.channels = 2;
+	}
+	if (SDL_AUDIO_ISFLOAT(spec.format) || SDL_AUDIO_BITSIZE(spec.format) > 16) {
+		clip_spec.format = AUDIO_F32SYS;
+	} else {
+		clip_spec.format = AUDIO_S16SYS;
+	}
+	
+	std::vector<uint8_t> samples;
+	if (spec.format == clip_spec.format && spec.channels == clip_spec.channels) {
+		// Already in a mixer format. Copy once.
+		samples.assign(file_buffer, file_buffer + file_bytes);
+		SDL_FreeWAV(file_buffer);
+		
+	} else {
+		// Use audio stream to convert loaded audio to desired format
+		SDL_AudioStream* stream = NULL;
+		stream = SDL_NewAudioStream(
+			spec.format, spec.channels, spec.freq,
+			clip_spec.format, clip_spec.channels, clip_spec.freq);
+		if (stream == NULL) {
+			SDL_FreeWAV(file_buffer);
+			throw std::runtime_error("unsupported audio format");
+		}
+		
+		// Put audio into stream. Stream keeps its own copy, so free file now.
+		int result = SDL_AudioStreamPut(stream, file_buffer, static_cast<int>(file_bytes));
+		SDL_FreeWAV(file_buffer);
+		if (result != 0) {
+			SDL_FreeAudioStream(stream);
+			throw std::runtime_error("audio conversion failure");
+		}
+		
+		// Convert audio
+		SDL_AudioStreamFlush(stream);
+		
+		// Get converted audio straight into samples, allocated once at exact size.
+		int clip_bytes = SDL_AudioStreamAvailable(stream);
+		if (clip_bytes <= 0) {
+			// 0 bytes breaks things, so it is an error too.
+			SDL_FreeAudioStream(stream);
+			throw std::runtime_error("audio conversion failure");
+		}
+		samples.resize(static_cast<size_t>(clip_bytes));
+		clip_bytes = SDL_AudioStreamGet(stream, samples.data(), clip_bytes);
+		SDL_FreeAudioStream(stream);
+		if (clip_bytes <= 0) {
+			throw std::runtime_error("audio conversion failure");
+		}
+		samples.resize(static_cast<size_t>(clip_bytes));
+	}
+	
+	// Drop any partial frame at the end.
+	size_t frame_bytes = static_cast<size_t>(clip_spec.channels) *
+		(SDL_AUDIO_BITSIZE(clip_spec.format) / 8);
+	size_t frames = samples.size() / frame_bytes;
+	if (frames == 0) {
+		throw std::runtime_error("audio file is empty");
+	}
+	samples.resize(frames * frame_bytes);
+	
+	// Nothing can fail from here, so replace the old samples.
+	this->unmap();
+	this->spec = clip_spec;
+	this->buffer.swap(samples);
+	this->frames = frames;
+	this->data = this->buffer.data();
+	this->bytes = this->buffer.size();
+	this->load_ms = static_cast<double>(SDL_GetPerformanceCounter() - start) * 1000.0 /
+		static_cast<double>(SDL_GetPerformanceFrequency());
+}
+
+// Load .wav file. Clips no longer depend on the audio device, so audio is unused.
+void ng::Clip::load (Audio*, const char* file) {
+	this->load(file);
+}
+
+// Baked clip header, little-endian, 32 bytes so samples stay aligned.
+static const uint32_t baked_magic = 0x4d43504e; // "NPCM"
+static const uint32_t baked_version = 1;
+static const size_t baked_header = 32;
+
+// Bake clip to a file that map loads with no decoding or copying.
+void ng::Clip::save (const char* file) {
+	if (this->data == NULL) {
+		throw std::logic_error("clip is not loaded");
+	}
+	SDL_RWops* rw = SDL_RWFromFile(file, "wb");
+	if (rw == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	// Format is written as is, so byte order is part of it.
+	bool ok =
+		SDL_WriteLE32(rw, baked_magic) == 1 &&
+		SDL_WriteLE32(rw, baked_version) == 1 &&
+		SDL_WriteLE16(rw, this->spec.format) == 1 &&
+		SDL_WriteLE16(rw, static_cast<uint16_t>(this->spec.channels)) == 1 &&
+		SDL_WriteLE32(rw, static_cast<uint32_t>(this->spec.freq)) == 1 &&
+		SDL_WriteLE64(rw, static_cast<uint64_t>(this->frames)) == 1 &&
+		SDL_WriteLE64(rw, 0) == 1 &&
+		SDL_RWwrite(rw, this->data, 1, this->bytes) == this->bytes;
+	if (SDL_RWclose(rw) != 0 || !ok) {
+		throw std::runtime_error(SDL_GetError());
+	}
+}
+
+// Read little-endian values from the header of a mapped file.
+static uint16_t baked_u16 (const uint8_t* p) {
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t baked_u32 (const uint8_t* p) {
+	return static_cast<uint32_t>(baked_u16(p)) |
+		(static_cast<uint32_t>(baked_u16(p + 2)) << 16);
+}
+
+static uint64_t baked_u64 (const uint8_t* p) {
+	return static_cast<uint64_t>(baked_u32(p)) |
+		(static_cast<uint64_t>(baked_u32(p + 4)) << 32);
+}
+
+// Map a baked file, and point data at its samples.
+void ng::Clip::map (const char* file) {
+	uint64_t start = SDL_GetPerformanceCounter();
+	this->unmap();
+	
+	void* mapped = NULL;
+	size_t mapped_bytes = 0;
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("can't open baked clip");
+	}
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(handle, &size)) {
+		mapped_bytes = static_cast<size_t>(size.QuadPart);
+		mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (mapping != NULL) {
+		mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		// The view keeps the file mapped after both handles close.
+		CloseHandle(mapping);
+	}
+	CloseHandle(handle);
+	if (mapped == NULL) {
+		throw std::runtime_error("can't map baked clip");
+	}
+#else
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("can't open baked clip");
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		mapped_bytes = static_cast<size_t>(st.st_size);
+		mapped = mmap(NULL, mapped_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			mapped = NULL;
+		}
+	}
+	// The mapping stays after the file closes.
+	close(fd);
+	if (mapped == NULL) {
+		throw std::runtime_error("can't map baked clip");
+	}
+#endif
+	this->mapped = mapped;
+	this->mapped_bytes = mapped_bytes;
+	
+	const uint8_t* p = static_cast<const uint8_t*>(mapped);
+	if (mapped_bytes < baked_header || baked_u32(p) != baked_magic ||
+	baked_u32(p + 4) != baked_version) {
+		this->unmap();
+		throw std::runtime_error("not a baked clip");
+	}
+	SDL_AudioFormat format = baked_u16(p + 8);
+	int channels = static_cast<int>(baked_u16(p + 10));
+	int freq = static_cast<int>(baked_u32(p + 12));
+	uint64_t frames = baked_u64(p + 16);
+	if (format != AUDIO_S16SYS && format != AUDIO_F32SYS) {
+		this->unmap();
+		throw std::runtime_error("baked clip has another byte order, bake it again");
+	}
+	size_t frame_bytes = static_cast<size_t>(channels) * (SDL_AUDIO_BITSIZE(format) / 8);
+	if ((channels != 1 && channels != 2) || freq <= 0 || frames == 0 ||
+	frames > (mapped_bytes - baked_header) / frame_bytes) {
+		this->unmap();
+		throw std::runtime_error("baked clip is damaged");
+	}
+	
+	SDL_zero(this->spec);
+	this->spec.format = format;
+	this->spec.channels = static_cast<uint8_t>(channels);
+	this->spec.freq = freq;
+	this->buffer.clear();
+	this->buffer.shrink_to_fit();
+	this->data = p + baked_header;
+	this->frames = static_cast<size_t>(frames);
+	this->bytes = this->frames * frame_bytes;
+	this->load_ms = static_cast<double>(SDL_GetPerformanceCounter() - start) * 1000.0 /
+		static_cast<double>(SDL_GetPerformanceFrequency());
+}
+
+// Unmap baked file, if any.
+void ng::Clip::unmap () {
+	if (this->mapped == NULL) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(this->mapped);
+#else
+	munmap(this->mapped, this->mapped_bytes);
+#endif
+	this->mapped = NULL;
+	this->mapped_bytes = 0;
+	this->data = NULL;
+	this->frames = 0;
+	this->bytes = 0;
+}
+
+// Read the header of a .wav file, leaving file at the first sample.
+// Only uncompressed PCM and float .wav files can be streamed.
+static void wav_header (SDL_RWops* file, SDL_AudioSpec* spec,
+int64_t* data_start, int64_t* data_bytes) {
+	if (SDL_ReadLE32(file) != 0x46464952 || // "RIFF"
+	SDL_ReadLE32(file) == 0 ||
+	SDL_ReadLE32(file) != 0x45564157) { // "WAVE"
+		throw std::runtime_error("not a wav file");
+	}
+	
+	bool has_fmt = false;
+	while (true) {
+		uint32_t id = SDL_ReadLE32(file);
+		uint32_t bytes = SDL_ReadLE32(file);
+		int64_t start = SDL_RWtell(file);
+		if (id == 0 || start < 0) {
+			throw std::runtime_error("wav file has no data");
+		}
+		
+		if (id == 0x20746d66) { // "fmt "
+			uint16_t tag = SDL_ReadLE16(file);
+			spec->channels = static_cast<uint8_t>(SDL_ReadLE16(file));
+			spec->freq = static_cast<int>(SDL_ReadLE32(file));
+			SDL_ReadLE32(file); // bytes per second
+			SDL_ReadLE16(file); // block align
+			uint16_t bits = SDL_ReadLE16(file);
+			if (tag == 1 && bits == 8) {
+				spec->format = AUDIO_U8;
+			} else if (tag == 1 && bits == 16) {
+				spec->format = AUDIO_S16LSB;
+			} else if (tag == 1 && bits == 32) {
+				spec->format = AUDIO_S32LSB;
+			} else if (tag == 3 && bits == 32) {
+				spec->format = AUDIO_F32LSB;
+			} else {
+				throw std::runtime_error("unsupported audio format");
+			}
+			has_fmt = true;
+			
+		} else if (id == 0x61746164) { // "data"
+			if (!has_fmt) {
+				throw std::runtime_error("wav file has no format");
+			}
+			*data_start = start;
+			*data_bytes = static_cast<int64_t>(bytes);
+			return;
+		}
+		
+		// Chunks are padded to an even number of bytes.
+		if (SDL_RWseek(file, start + bytes + (bytes & 1), RW_SEEK_SET) < 0) {
+			throw std::runtime_error("wav file has no data");
+		}
+	}
+}
+
+// Decoder thread.
+static int stream_thread (void* data) {
+	static_cast<ng::Stream*>(data)->decode();
+	return 0;
+}
+
+ng::Stream::Stream () {
+	this->file = NULL;
+	this->convert = NULL;
+	this->data_start = 0;
+	this->data_bytes = 0;
+	this->data_left = 0;
+	SDL_AtomicSet(&this->head, 0);
+	SDL_AtomicSet(&this->tail, 0);
+	this->thread = NULL;
+	SDL_AtomicSet(&this->running, 0);
+	SDL_AtomicSet(&this->loop, 0);
+	SDL_AtomicSet(&this->ended, 0);
+	SDL_AtomicSet(&this->used, 0);
+	this->wait = false;
+}
+
+ng::Stream::~Stream () {
+	this->close();
+}
+
+// Open .wav file and start decoding, with same spec as audio device.
+void ng::Stream::load (Audio* a, const char* file) {
+	this->close();
+	
+	this->file = SDL_RWFromFile(file, "rb");
+	if (this->file == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	
+	SDL_AudioSpec spec;
+	SDL_zero(spec);
+	try {
+		wav_header(this->file, &spec, &this->data_start, &this->data_bytes);
+	} catch (...) {
+		this->close();
+		throw;
+	}
+	if (this->data_bytes == 0) {
+		this->close();
+		throw std::runtime_error("wav file has no samples");
+	}
+	
+	// Use audio stream to convert each chunk to desired format
 	this->spec = a->spec;
-	SDL_AudioStream* stream = NULL;
-	stream = SDL_NewAudioStream(
+	this->wait = a->mode == ng::AudioOffline;
+	this->convert = SDL_NewAudioStream(
 		spec.format, spec.channels, spec.freq,
 		this->spec.format, this->spec.channels, this->spec.freq);
-	if (stream == NULL) {
-		SDL_FreeWAV(file_buffer);
+	if (this->convert == NULL) {
+		this->close();
 		throw std::runtime_error("unsupported audio format");
 	}
 	
-	// Put audio into stream
-	if (SDL_AudioStreamPut(stream, file_buffer, static_cast<int>(file_bytes)) != 0) {
-		SDL_FreeAudioStream(stream);
-		SDL_FreeWAV(file_buffer);
-		throw std::runtime_error("audio conversion failure");
+	// Ring holds about 0.75 seconds of stereo 44100Hz float32 audio = 256KB.
+	// Sizes are whole frames, so the ring never splits a frame.
+	size_t channels = static_cast<size_t>(this->spec.channels);
+	this->ring.assign(channels * 32768, 0.0f);
+	this->chunk.assign(channels * 1024, 0.0f);
+	this->data_left = this->data_bytes;
+	this->start();
+}
+
+// Stop decoding and close file.
+void ng::Stream::close () {
+	if (this->thread != NULL) {
+		SDL_AtomicSet(&this->running, 0);
+		SDL_WaitThread(this->thread, NULL);
+		this->thread = NULL;
+	}
+	if (this->convert != NULL) {
+		SDL_FreeAudioStream(this->convert);
+		this->convert = NULL;
+	}
+	if (this->file != NULL) {
+		SDL_RWclose(this->file);
+		this->file = NULL;
+	}
+}
+
+// Stop decoding, and start again from the first sample.
+void ng::Stream::rewind () {
+	if (this->file == NULL) {
+		return;
+	}
+	if (this->thread != NULL) {
+		SDL_AtomicSet(&this->running, 0);
+		SDL_WaitThread(this->thread, NULL);
+		this->thread = NULL;
+	}
+	if (SDL_RWseek(this->file, this->data_start, RW_SEEK_SET) < 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	SDL_AudioStreamClear(this->convert);
+	this->data_left = this->data_bytes;
+	this->start();
+}
+
+// Samples converted and not yet mixed.
+size_t ng::Stream::available () const {
+	int size = static_cast<int>(this->ring.size());
+	if (size == 0) {
+		return 0;
+	}
+	// const_cast because SDL_AtomicGet takes a non-const pointer.
+	int head = SDL_AtomicGet(const_cast<SDL_atomic_t*>(&this->head));
+	int tail = SDL_AtomicGet(const_cast<SDL_atomic_t*>(&this->tail));
+	return static_cast<size_t>((head - tail + size) % size);
+}
+
+// True when every sample has been mixed, and the stream is not looping.
+bool ng::Stream::done () const {
+	return SDL_AtomicGet(const_cast<SDL_atomic_t*>(&this->ended)) != 0 &&
+		this->available() == 0;
+}
+
+// Mix up to n converted samples times gain into dest. Returns samples mixed.
+size_t ng::Stream::mix (float* dest, float gain, size_t n) {
+	size_t mixed = this->mix_ready(dest, gain, n);
+	// Offline renders run faster than the decoder, so wait for it. Mixes as
+	// samples arrive, since n may be more than the ring holds.
+	while (this->wait && mixed < n) {
+		// Ended is read first, so no samples can arrive after the check.
+		bool ended = SDL_AtomicGet(&this->ended) != 0;
+		size_t got = this->mix_ready(dest + mixed, gain, n - mixed);
+		mixed += got;
+		if (got == 0) {
+			if (ended) {
+				break;
+			}
+			SDL_Delay(1);
+		}
+	}
+	return mixed;
+}
+
+// Mix up to n samples that are ready now. Returns samples mixed.
+size_t ng::Stream::mix_ready (float* dest, float gain, size_t n) {
+	size_t ready = this->available();
+	if (n > ready) {
+		n = ready;
+	}
+	size_t size = this->ring.size();
+	size_t tail = static_cast<size_t>(SDL_AtomicGet(&this->tail));
+	// At most two runs: up to the end of the ring, then from its start.
+	size_t run = size - tail;
+	if (run > n) {
+		run = n;
+	}
+	ng::mix_add_gain(dest, this->ring.data() + tail, gain, run);
+	ng::mix_add_gain(dest + run, this->ring.data(), gain, n - run);
+	SDL_AtomicSet(&this->tail, static_cast<int>((tail + n) % size));
+	return n;
+}
+
+// Start decoder thread.
+void ng::Stream::start () {
+	SDL_AtomicSet(&this->head, 0);
+	SDL_AtomicSet(&this->tail, 0);
+	SDL_AtomicSet(&this->ended, 0);
+	SDL_AtomicSet(&this->running, 1);
+	this->thread = SDL_CreateThread(stream_thread, "ng::Stream", this);
+	if (this->thread == NULL) {
+		SDL_AtomicSet(&this->running, 0);
+		throw std::runtime_error(SDL_GetError());
+	}
+}
+
+// Fill ring until stream is closed.
+void ng::Stream::decode () {
+	size_t size = this->ring.size();
+	size_t channels = static_cast<size_t>(this->spec.channels);
+	uint8_t bytes[4096];
+	bool flushed = false;
+	int64_t pass_read = 0; // bytes read since the last loop
+	
+	while (SDL_AtomicGet(&this->running)) {
+		// Move converted samples into the ring, as space allows.
+		// One slot stays empty, so head == tail always means empty.
+		size_t head = static_cast<size_t>(SDL_AtomicGet(&this->head));
+		size_t space = size - 1 - this->available();
+		size_t n = static_cast<size_t>(SDL_AudioStreamAvailable(this->convert)) / sizeof(float);
+		if (n > 0) {
+			if (n > space) {
+				n = space;
+			}
+			if (n > this->chunk.size()) {
+				n = this->chunk.size();
+			}
+			n -= n % channels;
+			if (n == 0) {
+				// Ring is full. Wait for the mixer.
+				SDL_Delay(10);
+				continue;
+			}
+			int got = SDL_AudioStreamGet(this->convert, this->chunk.data(),
+				static_cast<int>(n * sizeof(float)));
+			if (got <= 0) {
+				// Conversion failed, so nothing more is coming.
+				SDL_AtomicSet(&this->ended, 1);
+				break;
+			}
+			n = static_cast<size_t>(got) / sizeof(float);
+			for (size_t i=0; i < n; i++) {
+				this->ring[(head + i) % size] = this->chunk[i];
+			}
+			// SDL_AtomicSet is a full barrier, so samples are written before head moves.
+			SDL_AtomicSet(&this->head, static_cast<int>((head + n) % size));
+			continue;
+		}
+		
+		// Nothing converted. Read the next chunk of the file.
+		if (this->data_left == 0) {
+			// A pass that read nothing would loop forever, so it ends instead.
+			if (SDL_AtomicGet(&this->loop) && pass_read > 0) {
+				// Keep converter state, so the loop point has no seam.
+				SDL_RWseek(this->file, this->data_start, RW_SEEK_SET);
+				this->data_left = this->data_bytes;
+				pass_read = 0;
+			} else if (!flushed) {
+				SDL_AudioStreamFlush(this->convert);
+				flushed = true;
+			} else {
+				SDL_AtomicSet(&this->ended, 1);
+				break;
+			}
+			continue;
+		}
+		
+		size_t read = sizeof(bytes);
+		if (static_cast<int64_t>(read) > this->data_left) {
+			read = static_cast<size_t>(this->data_left);
+		}
+		read = SDL_RWread(this->file, bytes, 1, read);
+		if (read == 0) {
+			// File is shorter than its header says.
+			this->data_left = 0;
+			continue;
+		}
+		SDL_AudioStreamPut(this->convert, bytes, static_cast<int>(read));
+		this->data_left -= static_cast<int64_t>(read);
+		pass_read += static_cast<int64_t>(read);
+	}
+}
+
+ng::Sound::Sound () {
+	this->clip = NULL;
+	this->stream = NULL;
+	this->sample = 0;
+	this->position = 0;
+	this->mode = ng::None;
+	this->priority = 0;
+	this->volume = 1.0f;
+	this->age = 0;
+	this->start = 0;
+	this->render = NULL;
+	this->render_key = 0;
+}
+
+ng::Sound::~Sound () {}
+
+void ng::Sound::set (Clip* clip, int mode) {
+	this->clip = clip;
+	this->stream = NULL;
+	this->sample = 0;
+	this->position = 0;
+	this->mode = mode;
+	this->start = 0;
+	this->render = NULL;
+	this->render_key = 0;
+}
+
+void ng::Sound::set (Stream* stream, int mode) {
+	this->clip = NULL;
+	this->stream = stream;
+	this->sample = 0;
+	this->position = 0;
+	this->mode = mode;
+	this->start = 0;
+}
+
+void ng::Sound::set (int priority, float volume) {
+	this->priority = priority;
+	this->volume = volume;
+}
+
+void ng::Sound::set (uint64_t start) {
+	this->start = start;
+}
+
+ng::Bus::Bus () {
+	this->parent = NULL;
+	this->volume = 1.0f;
+}
+
+ng::Bus::~Bus () {}
+
+ng::Effect::Effect () {
+	this->mode = ng::None;
+	this->freq = 1000.0f;
+	this->q = 0.707f;
+	this->b0 = 1.0f;
+	this->b1 = 0.0f;
+	this->b2 = 0.0f;
+	this->a1 = 0.0f;
+	this->a2 = 0.0f;
+	this->delay_ms = 0.0f;
+	this->feedback = 0.0f;
+	this->wet = 0.0f;
+	this->line_samples = 0;
+	this->line_pos = 0;
+	this->threshold_dB = 0.0f;
+	this->ratio = 1.0f;
+	this->attack_ms = 0.0f;
+	this->release_ms = 0.0f;
+	this->spec_freq = 0;
+	this->spec_channels = 0;
+	this->reset();
+}
+
+ng::Effect::~Effect () {}
+
+// Low pass biquad at freq Hz, with q (0.707 is flat).
+void ng::Effect::set_lowpass (float freq, float q) {
+	if (freq <= 0.0f || q <= 0.0f) {
+		throw std::logic_error("lowpass freq and q must be > 0");
+	}
+	this->mode = ng::EffectLowPass;
+	this->freq = freq;
+	this->q = q;
+	this->spec_freq = 0;
+}
+
+// High pass biquad at freq Hz, with q (0.707 is flat).
+void ng::Effect::set_highpass (float freq, float q) {
+	if (freq <= 0.0f || q <= 0.0f) {
+		throw std::logic_error("highpass freq and q must be > 0");
+	}
+	this->mode = ng::EffectHighPass;
+	this->freq = freq;
+	this->q = q;
+	this->spec_freq = 0;
+}
+
+// Echo after ms, with feedback [0, 1), and wet gain of the echo.
+void ng::Effect::set_delay (float ms, float feedback, float wet) {
+	if (ms <= 0.0f || feedback < 0.0f || feedback >= 1.0f) {
+		throw std::logic_error("delay ms must be > 0, and feedback in [0, 1)");
+	}
+	this->mode = ng::EffectDelay;
+	this->delay_ms = ms;
+	this->feedback = feedback;
+	this->wet = wet;
+	this->spec_freq = 0;
+}
+
+// Reduce gain above threshold dB by ratio, with attack and release in ms.
+void ng::Effect::set_compressor (float threshold_dB, float ratio, float attack_ms,
+float release_ms) {
+	if (ratio < 1.0f || attack_ms < 0.0f || release_ms < 0.0f) {
+		throw std::logic_error("compressor ratio must be >= 1, and times >= 0");
+	}
+	this->mode = ng::EffectCompressor;
+	this->threshold_dB = threshold_dB;
+	this->ratio = ratio;
+	this->attack_ms = attack_ms;
+	this->release_ms = release_ms;
+	this->spec_freq = 0;
+}
+
+// Keep peaks at or below threshold dB, with release in ms.
+void ng::Effect::set_limiter (float threshold_dB, float release_ms) {
+	if (release_ms < 0.0f) {
+		throw std::logic_error("limiter release must be >= 0");
+	}
+	this->mode = ng::EffectLimiter;
+	this->threshold_dB = threshold_dB;
+	this->ratio = 1.0f;
+	this->attack_ms = 0.0f;
+	this->release_ms = release_ms;
+	this->spec_freq = 0;
+}
+
+// Silence state, such as the delay line and filter history.
+void ng::Effect::reset () {
+	for (int c=0; c < 2; c++) {
+		this->z1[c] = 0.0f;
+		this->z2[c] = 0.0f;
+	}
+	this->line.assign(this->line.size(), 0.0f);
+	this->line_pos = 0;
+	this->envelope = 0.0f;
+	this->gain = 1.0f;
+}
+
+// Dynamics run their envelope once per block of frames, then ramp gain across
+// the block toward the gain for that envelope.
+static const size_t effect_block = 32;
+
+// Coefficient for a one-pole envelope, per block, with time constant ms.
+static float envelope_coef (float ms, int freq) {
+	if (ms <= 0.0f) {
+		return 0.0f;
+	}
+	double blocks = static_cast<double>(ms) * static_cast<double>(freq) /
+		(1000.0 * static_cast<double>(effect_block));
+	return static_cast<float>(std::exp(-1.0 / blocks));
+}
+
+// Size state for rate and channels, then update. Allocates.
+void ng::Effect::prepare (const SDL_AudioSpec& spec) {
+	this->spec_freq = spec.freq;
+	this->spec_channels = spec.channels;
+	if (this->mode == ng::EffectDelay) {
+		size_t frames = static_cast<size_t>(this->delay_ms *
+			static_cast<float>(spec.freq) / 1000.0f);
+		if (frames == 0) {
+			frames = 1;
+		}
+		this->line.assign(frames * static_cast<size_t>(spec.channels), 0.0f);
+	}
+	this->update();
+	this->reset();
+}
+
+// Compute coefficients for the prepared rate, without allocating.
+void ng::Effect::update () {
+	switch (this->mode) {
+	case ng::EffectLowPass:
+	case ng::EffectHighPass: {
+		// Audio EQ cookbook, by Robert Bristow-Johnson.
+		double w0 = ng::radians(360.0 * static_cast<double>(this->freq) /
+			static_cast<double>(this->spec_freq));
+		double cos_w0 = std::cos(w0);
+		double alpha = std::sin(w0) / (2.0 * static_cast<double>(this->q));
+		double a0 = 1.0 + alpha;
+		double b1;
+		if (this->mode == ng::EffectLowPass) {
+			b1 = 1.0 - cos_w0;
+		} else {
+			b1 = -(1.0 + cos_w0);
+		}
+		this->b0 = static_cast<float>((b1 / 2.0) / a0);
+		if (this->mode == ng::EffectHighPass) {
+			this->b0 = -this->b0;
+		}
+		this->b1 = static_cast<float>(b1 / a0);
+		this->b2 = this->b0;
+		this->a1 = static_cast<float>((-2.0 * cos_w0) / a0);
+		this->a2 = static_cast<float>((1.0 - alpha) / a0);
+		break;
+	}
+	case ng::EffectDelay: {
+		// Line is sized by prepare. A shorter delay uses the front of it.
+		size_t frames = static_cast<size_t>(this->delay_ms *
+			static_cast<float>(this->spec_freq) / 1000.0f);
+		if (frames == 0) {
+			frames = 1;
+		}
+		this->line_samples = frames * static_cast<size_t>(this->spec_channels);
+		if (this->line_samples > this->line.size()) {
+			this->line_samples = this->line.size();
+		}
+		if (this->line_samples > 0) {
+			this->line_pos %= this->line_samples;
+		}
+		break;
+	}
+	case ng::EffectCompressor:
+	case ng::EffectLimiter:
+		this->attack = envelope_coef(this->attack_ms, this->spec_freq);
+		this->release = envelope_coef(this->release_ms, this->spec_freq);
+		break;
+	default:
+		break;
+	}
+}
+
+// Settings from the set_ method, in order, up to 4.
+void ng::Effect::get_settings (float* const settings) const {
+	for (int i=0; i < 4; i++) {
+		settings[i] = 0.0f;
+	}
+	switch (this->mode) {
+	case ng::EffectLowPass:
+	case ng::EffectHighPass:
+		settings[0] = this->freq;
+		settings[1] = this->q;
+		break;
+	case ng::EffectDelay:
+		settings[0] = this->delay_ms;
+		settings[1] = this->feedback;
+		settings[2] = this->wet;
+		break;
+	case ng::EffectCompressor:
+	case ng::EffectLimiter:
+		settings[0] = this->threshold_dB;
+		settings[1] = this->ratio;
+		settings[2] = this->attack_ms;
+		settings[3] = this->release_ms;
+		break;
+	default:
+		break;
+	}
+}
+
+// Take mode and settings from get_settings, keeping state.
+void ng::Effect::apply_settings (int mode, const float* settings) {
+	this->mode = mode;
+	switch (mode) {
+	case ng::EffectLowPass:
+	case ng::EffectHighPass:
+		this->freq = settings[0];
+		this->q = settings[1];
+		break;
+	case ng::EffectDelay:
+		this->delay_ms = settings[0];
+		this->feedback = settings[1];
+		this->wet = settings[2];
+		break;
+	case ng::EffectCompressor:
+	case ng::EffectLimiter:
+		this->threshold_dB = settings[0];
+		this->ratio = settings[1];
+		this->attack_ms = settings[2];
+		this->release_ms = settings[3];
+		break;
+	default:
+		break;
+	}
+	if (this->spec_freq != 0) {
+		this->update();
+	}
+}
+
+// Process frames of interleaved samples in place.
+void ng::Effect::process (float* buffer, size_t frames, const SDL_AudioSpec& spec) {
+	if (this->mode == ng::None || frames == 0) {
+		return;
+	}
+	if (spec.freq != this->spec_freq || spec.channels != this->spec_channels) {
+		this->prepare(spec);
+	}
+	
+	int channels = spec.channels;
+	switch (this->mode) {
+	case ng::EffectLowPass:
+	case ng::EffectHighPass:
+		this->process_biquad(buffer, frames, channels);
+		break;
+	case ng::EffectDelay:
+		this->process_delay(buffer, frames, channels);
+		break;
+	case ng::EffectCompressor:
+	case ng::EffectLimiter:
+		this->process_dynamics(buffer, frames, channels);
+		break;
+	default:
+		break;
+	}
+}
+
+// Each output depends on the last, so frames run in order. Both channels of a
+// frame are filtered together, from state kept in registers for the block.
+void ng::Effect::process_biquad (float* buffer, size_t frames, int channels) {
+	float b0 = this->b0;
+	float b1 = this->b1;
+	float b2 = this->b2;
+	float a1 = this->a1;
+	float a2 = this->a2;
+	if (channels == 2) {
+		float l1 = this->z1[0];
+		float l2 = this->z2[0];
+		float r1 = this->z1[1];
+		float r2 = this->z2[1];
+		for (size_t i=0; i < frames; i++) {
+			float l = buffer[i*2];
+			float r = buffer[i*2+1];
+			float yl = b0*l + l1;
+			float yr = b0*r + r1;
+			l1 = b1*l - a1*yl + l2;
+			r1 = b1*r - a1*yr + r2;
+			l2 = b2*l - a2*yl;
+			r2 = b2*r - a2*yr;
+			buffer[i*2] = yl;
+			buffer[i*2+1] = yr;
+		}
+		this->z1[0] = l1;
+		this->z2[0] = l2;
+		this->z1[1] = r1;
+		this->z2[1] = r2;
+	} else {
+		for (int c=0; c < channels && c < 2; c++) {
+			float z1 = this->z1[c];
+			float z2 = this->z2[c];
+			for (size_t i=0; i < frames; i++) {
+				float x = buffer[i*channels+c];
+				float y = b0*x + z1;
+				z1 = b1*x - a1*y + z2;
+				z2 = b2*x - a2*y;
+				buffer[i*channels+c] = y;
+			}
+			this->z1[c] = z1;
+			this->z2[c] = z2;
+		}
+	}
+}
+
+// Output is x + wet*d, and the line keeps x + feedback*d, where d is the
+// delayed sample. Runs between line wraps are contiguous, so both are done
+// with vector kernels: y = x + wet*d, then d = (feedback - wet)*d + y.
+void ng::Effect::process_delay (float* buffer, size_t frames, int channels) {
+	size_t n = frames * static_cast<size_t>(channels);
+	size_t size = this->line_samples;
+	size_t i = 0;
+	while (i < n) {
+		size_t run = size - this->line_pos;
+		if (run > n - i) {
+			run = n - i;
+		}
+		float* x = buffer + i;
+		float* d = this->line.data() + this->line_pos;
+		ng::mix_add_gain(x, d, this->wet, run);
+		ng::mix_gain(d, this->feedback - this->wet, run);
+		ng::mix_add(d, x, run);
+		i += run;
+		this->line_pos = (this->line_pos + run) % size;
+	}
+}
+
+// Envelope follows the peak of each block, and gain ramps per frame from the
+// last block's gain to this block's, so it never steps. A limiter takes a lower
+// gain at the start of the block instead, so it never lets a peak through.
+void ng::Effect::process_dynamics (float* buffer, size_t frames, int channels) {
+	float threshold = ng::dB_to_amp(this->threshold_dB);
+	for (size_t f=0; f < frames; f += effect_block) {
+		size_t block = effect_block;
+		if (block > frames - f) {
+			block = frames - f;
+		}
+		float* x = buffer + f * static_cast<size_t>(channels);
+		size_t n = block * static_cast<size_t>(channels);
+		
+		float peak = 0.0f;
+		for (size_t i=0; i < n; i++) {
+			float a = std::fabs(x[i]);
+			if (a > peak) {
+				peak = a;
+			}
+		}
+		float coef = (peak > this->envelope) ? this->attack : this->release;
+		this->envelope = peak + coef * (this->envelope - peak);
+		
+		float gain = 1.0f;
+		if (this->envelope > threshold) {
+			if (this->mode == ng::EffectLimiter) {
+				gain = threshold / this->envelope;
+			} else {
+				float over_dB = ng::amp_to_dB(this->envelope) - this->threshold_dB;
+				gain = ng::dB_to_amp(-over_dB * (1.0f - 1.0f / this->ratio));
+			}
+		}
+		float start = this->gain;
+		if (this->mode == ng::EffectLimiter && gain < start) {
+			start = gain;
+		}
+		this->gain = gain;
+		
+		if (start == gain) {
+			if (gain != 1.0f) {
+				ng::mix_gain(x, gain, n);
+			}
+			continue;
+		}
+		float step = (gain - start) / static_cast<float>(block);
+		for (size_t i=0; i < block; i++) {
+			float g = start + step * static_cast<float>(i + 1);
+			for (int c=0; c < channels; c++) {
+				x[i*channels+c] *= g;
+			}
+		}
+	}
+}
+
+ng::Channel::Channel () {
+	this->bus = NULL;
+	this->sounds = 0;
+	this->plays = 0;
+	this->steal = ng::StealOldest;
+	SDL_zero(this->spec);
+	this->spec.freq = 44100;
+	this->spec.format = AUDIO_F32SYS;
+	this->spec.channels = 2;
+	this->volume = 1.0f;
+	this->resample = ng::ResampleLinear;
+	this->frame = 0;
+	this->mixed = 0;
+	this->set_voices(32);
+}
+
+ng::Channel::~Channel () {}
+
+// Add effect to the end of the chain.
+void ng::Channel::add_effect (Effect* effect) {
+	this->effects.push_back(effect);
+}
+
+// Allocate a pool of max voices, and remove all queued sounds.
+void ng::Channel::set_voices (size_t max) {
+	for (size_t i=0; i < this->sounds; i++) {
+		this->end_stream(i);
+	}
+	this->queue.assign(max, Sound());
+	this->sounds = 0;
+}
+
+// Queue a sound with EnumSound mode.
+bool ng::Channel::play_sound (Clip* c, int mode) {
+	Sound sound;
+	sound.set(c, mode);
+	return this->add_sound(sound);
+}
+
+bool ng::Channel::play_sound (Clip* c, int mode, int priority, float volume) {
+	Sound sound;
+	sound.set(c, mode);
+	sound.set(priority, volume);
+	return this->add_sound(sound);
+}
+
+// Queue a stream with EnumSound mode. Stream plays from where it is.
+bool ng::Channel::play_sound (Stream* s, int mode) {
+	if (!this->use_stream(s)) {
+		return false;
+	}
+	SDL_AtomicSet(&s->loop, mode == ng::SoundLoop ? 1 : 0);
+	Sound sound;
+	sound.set(s, mode);
+	if (!this->add_sound(sound)) {
+		SDL_AtomicSet(&s->used, 0);
+		return false;
+	}
+	return true;
+}
+
+// Queue a sound or stream to start exactly on audio timeline frame.
+bool ng::Channel::play_sound_at (Clip* c, int mode, uint64_t frame) {
+	Sound sound;
+	sound.set(c, mode);
+	sound.set(frame);
+	return this->add_sound(sound);
+}
+
+bool ng::Channel::play_sound_at (Clip* c, int mode, int priority, float volume,
+uint64_t frame) {
+	Sound sound;
+	sound.set(c, mode);
+	sound.set(priority, volume);
+	sound.set(frame);
+	return this->add_sound(sound);
+}
+
+bool ng::Channel::play_sound_at (Stream* s, int mode, uint64_t frame) {
+	if (!this->use_stream(s)) {
+		return false;
+	}
+	SDL_AtomicSet(&s->loop, mode == ng::SoundLoop ? 1 : 0);
+	Sound sound;
+	sound.set(s, mode);
+	sound.set(frame);
+	if (!this->add_sound(sound)) {
+		SDL_AtomicSet(&s->used, 0);
+		return false;
+	}
+	return true;
+}
+
+// Copy sound into a free or stolen voice.
+bool ng::Channel::add_sound (const Sound& sound) {
+	size_t voice = this->sounds;
+	if (voice == this->queue.size()) {
+		// Pool is full. Steal the lowest priority voice, and of those the
+		// oldest or quietest.
+		if (voice == 0) {
+			return false;
+		}
+		voice = 0;
+		for (size_t i=1; i < this->sounds; i++) {
+			const Sound& a = this->queue[i];
+			const Sound& b = this->queue[voice];
+			if (a.priority != b.priority) {
+				if (a.priority < b.priority) {
+					voice = i;
+				}
+			} else if (this->steal == ng::StealQuietest && a.volume != b.volume) {
+				if (a.volume < b.volume) {
+					voice = i;
+				}
+			} else if (a.age < b.age) {
+				voice = i;
+			}
+		}
+		if (this->queue[voice].priority > sound.priority) {
+			return false;
+		}
+		this->end_stream(voice);
+	} else {
+		this->sounds++;
+	}
+	this->queue[voice] = sound;
+	this->queue[voice].age = this->plays;
+	this->plays++;
+	return true;
+}
+
+// Take stream for one voice. Returns false if another voice has it.
+bool ng::Channel::use_stream (Stream* s) {
+	return SDL_AtomicCAS(&s->used, 0, 1) == SDL_TRUE;
+}
+
+// Let go of the stream played by voice, if any, so it can play again.
+void ng::Channel::end_stream (size_t sound) {
+	if (this->queue[sound].stream != NULL) {
+		SDL_AtomicSet(&this->queue[sound].stream->used, 0);
+	}
+}
+
+// Remove queued sound, by moving the last sound into its voice.
+void ng::Channel::remove_sound (size_t sound) {
+	if (sound >= this->sounds) {
+		return;
+	}
+	this->end_stream(sound);
+	this->sounds--;
+	this->queue[sound] = this->queue[this->sounds];
+}
+
+// Remove all queued sounds.
+void ng::Channel::stop () {
+	for (size_t i=0; i < this->sounds; i++) {
+		this->end_stream(i);
+	}
+	this->sounds = 0;
+}
+
+// Allocate samples for buffer and fill with silence.
+void ng::Channel::clear (size_t samples) {
+	// Silence is 0 in linear amplitude. Keeps capacity between calls.
+	this->buffer.assign(samples, 0.0f);
+}
+
+// Frame f of clip, wrapped if looping, else held at the first or last frame.
+static size_t clip_frame (const ng::Clip* clip, int64_t f, bool loop) {
+	int64_t frames = static_cast<int64_t>(clip->frames);
+	if (loop) {
+		f %= frames;
+		if (f < 0) {
+			f += frames;
+		}
+	} else if (f < 0) {
+		f = 0;
+	} else if (f >= frames) {
+		f = frames - 1;
+	}
+	return static_cast<size_t>(f);
+}
+
+// Sample as float, in linear amplitude.
+static inline float clip_sample (int16_t x) {
+	return static_cast<float>(x) * (1.0f / 32768.0f);
+}
+
+static inline float clip_sample (float x) {
+	return x;
+}
+
+// Value at fraction t [0, 1) between p1 and p2, with EnumResample R.
+template <int R>
+static inline float clip_interpolate (float p0, float p1, float p2, float p3, float t) {
+	if (R != ng::ResampleCubic) {
+		return p1 + ((p2 - p1) * t);
+	}
+	// Catmull-Rom spline through 4 frames.
+	float a0 = (-0.5f*p0) + (1.5f*p1) - (1.5f*p2) + (0.5f*p3);
+	float a1 = p0 - (2.5f*p1) + (2.0f*p2) - (0.5f*p3);
+	float a2 = (-0.5f*p0) + (0.5f*p2);
+	return (((((a0 * t) + a1) * t) + a2) * t) + p1;
+}
+
+// Render kernel for one voice, compiled for each source sample type T
+// (int16_t or float), clip channels C (1 or 2), loop L, EnumResample R, and
+// output channels O (1, or 2 for 2 or more). Mixes up to n frames into out,
+// stride samples apart, from 32.32 fixed point position p, and returns frames
+// mixed. Fewer than n means a sound that does not loop has ended.
+// Stereo clips mix into mono output as (left + right) / 2.
+// Frames whose neighbours are all inside the clip are mixed in runs with no
+// bounds or wrap checks. Only frames at the clip edges take the slow path.
+template <typename T, int C, bool L, int R, int O>
+static size_t render_clip (const ng::Clip* clip, float* out, size_t stride, size_t n,
+uint64_t* position, uint64_t step, float gain) {
+	const T* data = reinterpret_cast<const T*>(clip->data);
+	int64_t frames = static_cast<int64_t>(clip->frames);
+	uint64_t end = static_cast<uint64_t>(clip->frames) << 32;
+	// Frames [lo, hi] have every neighbour the resampler reads.
+	int64_t lo = (R == ng::ResampleCubic) ? 1 : 0;
+	int64_t hi = frames - ((R == ng::ResampleCubic) ? 3 : 2);
+	uint64_t p = *position;
+	
+	size_t i = 0;
+	while (i < n) {
+		if (p >= end) {
+			if (!L) {
+				break;
+			}
+			p %= end;
+		}
+		int64_t f = static_cast<int64_t>(p >> 32);
+		
+		if (f >= lo && f <= hi) {
+			// Outputs until the position passes hi, at least 1.
+			uint64_t run = (((static_cast<uint64_t>(hi) + 1) << 32) - p + step - 1) / step;
+			if (run > n - i) {
+				run = n - i;
+			}
+			for (uint64_t k=0; k < run; k++) {
+				const T* s = data + ((p >> 32) * C);
+				float t = static_cast<float>(p & 0xffffffff) * (1.0f / 4294967296.0f);
+				float left, right;
+				if (R == ng::ResampleCubic) {
+					left = clip_interpolate<R>(clip_sample(s[-C]), clip_sample(s[0]),
+						clip_sample(s[C]), clip_sample(s[2*C]), t);
+				} else {
+					left = clip_interpolate<R>(0.0f, clip_sample(s[0]),
+						clip_sample(s[C]), 0.0f, t);
+				}
+				right = left;
+				if (C == 2) {
+					if (R == ng::ResampleCubic) {
+						right = clip_interpolate<R>(clip_sample(s[-1]), clip_sample(s[1]),
+							clip_sample(s[3]), clip_sample(s[5]), t);
+					} else {
+						right = clip_interpolate<R>(0.0f, clip_sample(s[1]),
+							clip_sample(s[3]), 0.0f, t);
+					}
+				}
+				if (O == 2) {
+					out[0] += left * gain;
+					out[1] += right * gain;
+				} else if (C == 2) {
+					out[0] += (left + right) * 0.5f * gain;
+				} else {
+					out[0] += left * gain;
+				}
+				out += stride;
+				p += step;
+			}
+			i += static_cast<size_t>(run);
+			continue;
+		}
+		
+		// Edge frame. Neighbours wrap if looping, else hold the first or last frame.
+		const T* s0 = data + (clip_frame(clip, f-1, L) * C);
+		const T* s1 = data + (static_cast<size_t>(f) * C);
+		const T* s2 = data + (clip_frame(clip, f+1, L) * C);
+		const T* s3 = data + (clip_frame(clip, f+2, L) * C);
+		float t = static_cast<float>(p & 0xffffffff) * (1.0f / 4294967296.0f);
+		float left = clip_interpolate<R>(clip_sample(s0[0]), clip_sample(s1[0]),
+			clip_sample(s2[0]), clip_sample(s3[0]), t);
+		float right = left;
+		if (C == 2) {
+			right = clip_interpolate<R>(clip_sample(s0[1]), clip_sample(s1[1]),
+				clip_sample(s2[1]), clip_sample(s3[1]), t);
+		}
+		if (O == 2) {
+			out[0] += left * gain;
+			out[1] += right * gain;
+		} else if (C == 2) {
+			out[0] += (left + right) * 0.5f * gain;
+		} else {
+			out[0] += left * gain;
+		}
+		out += stride;
+		p += step;
+		i++;
+	}
+	
+	*position = p;
+	return i;
+}
+
+// Pick the render kernel for a voice, one template parameter at a time.
+template <typename T, int C, bool L, int R>
+static ng::RenderClip render_clip_pick (int out_channels) {
+	if (out_channels == 1) {
+		return render_clip<T, C, L, R, 1>;
+	}
+	return render_clip<T, C, L, R, 2>;
+}
+
+template <typename T, int C, bool L>
+static ng::RenderClip render_clip_pick (int resample, int out_channels) {
+	if (resample == ng::ResampleCubic) {
+		return render_clip_pick<T, C, L, ng::ResampleCubic>(out_channels);
+	}
+	return render_clip_pick<T, C, L, ng::ResampleLinear>(out_channels);
+}
+
+template <typename T, int C>
+static ng::RenderClip render_clip_pick (bool loop, int resample, int out_channels) {
+	if (loop) {
+		return render_clip_pick<T, C, true>(resample, out_channels);
+	}
+	return render_clip_pick<T, C, false>(resample, out_channels);
+}
+
+template <typename T>
+static ng::RenderClip render_clip_pick (int clip_channels, bool loop, int resample,
+int out_channels) {
+	if (clip_channels == 2) {
+		return render_clip_pick<T, 2>(loop, resample, out_channels);
+	}
+	return render_clip_pick<T, 1>(loop, resample, out_channels);
+}
+
+// Render kernel for clip format and channels, loop, resample, and device channels.
+static ng::RenderClip render_clip_select (const ng::Clip* clip, bool loop, int resample,
+int out_channels) {
+	int clip_channels = static_cast<int>(clip->spec.channels);
+	if (clip->spec.format == AUDIO_S16SYS) {
+		return render_clip_pick<int16_t>(clip_channels, loop, resample, out_channels);
+	}
+	return render_clip_pick<float>(clip_channels, loop, resample, out_channels);
+}
+
+// Frame in channel buffer the sound starts on, or frames if it starts later.
+size_t ng::Channel::start_frame (size_t sound, size_t frames) {
+	uint64_t start = this->queue[sound].start;
+	if (start <= this->frame) {
+		return 0;
+	}
+	if (start - this->frame >= frames) {
+		return frames;
+	}
+	return static_cast<size_t>(start - this->frame);
+}
+
+// Mix samples from sound clip into channel buffer.
+int ng::Channel::mix_sound (size_t sound) {
+	if (this->queue[sound].stream != NULL) {
+		return this->mix_stream(sound);
+	}
+	
+	Clip* clip = this->queue[sound].clip;
+	bool loop = this->queue[sound].mode == ng::SoundLoop;
+	int channels = static_cast<int>(this->spec.channels);
+	size_t frames = this->buffer.size() / static_cast<size_t>(channels);
+	// A scheduled sound waits, silent, until its frame on the audio timeline.
+	size_t first = this->start_frame(sound, frames);
+	if (first == frames) {
+		return ng::None;
 	}
 	
-	// Convert audio
-	SDL_AudioStreamFlush(stream);
+	// Position and step are 32.32 fixed point frames, so the same clip always
+	// mixes to the same samples, however the buffers are split.
+	uint64_t step = (static_cast<uint64_t>(clip->spec.freq) << 32) /
+		static_cast<uint64_t>(this->spec.freq);
+	float gain = ng::volume_to_amp(this->queue[sound].volume);
+	float* out = this->buffer.data() + first * static_cast<size_t>(channels);
 	
-	// Get converted audio
-	// Max 10 minutes (600 seconds) of stereo 44100Hz float32 audio = 212MB!
-	int clip_max = static_cast<int>(this->spec.freq) * 600 *
-		static_cast<int>(this->spec.channels) * sizeof(float);
-	float* buf = static_cast<float*>(std::malloc(clip_max));
-	int clip_bytes = SDL_AudioStreamGet(stream, buf, clip_max);
-	SDL_FreeAudioStream(stream);
-	SDL_FreeWAV(file_buffer);
-	if (clip_bytes <= 0) {
-		// Technically an error is -1, but 0 bytes breaks things so catch that too.
-		throw std::runtime_error("audio conversion failure");
+	// Mono goes to left and right. Stereo goes to left and right.
+	// Other device channels are left silent.
+	// The kernel is picked once per voice, and again only if what it was
+	// compiled for changes.
+	uint32_t key = (static_cast<uint32_t>(clip->spec.format) << 16) |
+		(static_cast<uint32_t>(clip->spec.channels) << 8) |
+		(static_cast<uint32_t>(this->resample) << 4) |
+		static_cast<uint32_t>(channels);
+	Sound* voice = &this->queue[sound];
+	if (voice->render == NULL || voice->render_key != key) {
+		voice->render = render_clip_select(clip, loop, this->resample, channels);
+		voice->render_key = key;
+	}
+	size_t n = frames - first;
+	if (voice->render(clip, out, static_cast<size_t>(channels), n, &this->queue[sound].position,
+	step, gain) < n) {
+		// Returns ng::SoundComplete if sound completes during the mix.
+		this->queue[sound].mode = ng::SoundComplete;
+		return ng::SoundComplete;
+	}
+	return ng::None;
+}
+
+// Mix samples from sound stream into channel buffer.
+int ng::Channel::mix_stream (size_t sound) {
+	Stream* stream = this->queue[sound].stream;
+	size_t channels = static_cast<size_t>(this->spec.channels);
+	size_t first = this->start_frame(sound, this->buffer.size() / channels) * channels;
+	if (first == this->buffer.size()) {
+		return ng::None;
+	}
+	// If the decoder falls behind, mixes what is ready and leaves a gap.
+	// Offline mode waits for the decoder instead.
+	float gain = ng::volume_to_amp(this->queue[sound].volume);
+	size_t want = this->buffer.size() - first;
+	size_t n = stream->mix(this->buffer.data() + first, gain, want);
+	this->queue[sound].sample += n;
+	// Returns ng::SoundComplete once the stream has ended and every sample is mixed.
+	if (n < want && stream->done()) {
+		this->queue[sound].mode = ng::SoundComplete;
+		return ng::SoundComplete;
+	}
+	return ng::None;
+}
+
+// Mix sounds into channel buffer.
+void ng::Channel::mix () {
+	this->mixed = this->sounds;
+	// Removing a sound moves the last one into i, so only step when kept.
+	for (size_t i=0; i < this->sounds;) {
+		if (this->mix_sound(i) == ng::SoundComplete) {
+			this->remove_sound(i);
+		} else {
+			i++;
+		}
 	}
 	
-	// Compute samples and resize buffer
-	size_t samples = clip_bytes / sizeof(float);
-	for (size_t i=0; i < samples; i++) {
-		this->buffer.push_back(buf[i]);
+	size_t frames = this->buffer.size() / static_cast<size_t>(this->spec.channels);
+	for (size_t i=0; i < this->effects.size(); i++) {
+		this->effects[i]->process(this->buffer.data(), frames, this->spec);
 	}
-	std::free(buf);
 }
 
-ng::Sound::Sound () {
-	this->clip = NULL;
-	this->sample = 0;
+ng::Command::Command () {
 	this->mode = ng::None;
+	this->channel = NULL;
+	this->bus = NULL;
+	this->clip = NULL;
+	this->stream = NULL;
+	this->sound = ng::None;
+	this->priority = 0;
+	this->volume = 1.0f;
+	this->frame = 0;
+	this->effect = NULL;
+	this->effect_mode = ng::None;
+	for (int i=0; i < 4; i++) {
+		this->settings[i] = 0.0f;
+	}
 }
 
-ng::Sound::~Sound () {}
+ng::Command::~Command () {}
 
-void ng::Sound::set (Clip* clip, int mode) {
-	this->clip = clip;
-	this->sample = 0;
-	this->mode = mode;
+ng::CommandQueue::CommandQueue () {
+	SDL_AtomicSet(&this->head, 0);
+	SDL_AtomicSet(&this->tail, 0);
 }
 
-ng::Channel::Channel () {
-	this->volume = 1.0f;
-}
+ng::CommandQueue::~CommandQueue () {}
 
-ng::Channel::~Channel () {}
+// Allocate room for capacity commands and empty the queue.
+void ng::CommandQueue::reset (size_t capacity) {
+	// One slot stays empty, so head == tail always means empty.
+	this->buffer.assign(capacity + 1, Command());
+	SDL_AtomicSet(&this->head, 0);
+	SDL_AtomicSet(&this->tail, 0);
+}
 
-// Queue a sound with EnumSound mode.
-void ng::Channel::play_sound (Clip* c, int mode) {
-	Sound sound;
-	sound.set(c, mode);
-	this->queue.push_back(sound);
+// Producer. Returns false if queue is full.
+bool ng::CommandQueue::push (const Command& command) {
+	int size = static_cast<int>(this->buffer.size());
+	if (size == 0) {
+		return false;
+	}
+	int head = SDL_AtomicGet(&this->head);
+	int next = (head + 1) % size;
+	if (next == SDL_AtomicGet(&this->tail)) {
+		return false;
+	}
+	this->buffer[head] = command;
+	// SDL_AtomicSet is a full barrier, so the command is written before head moves.
+	SDL_AtomicSet(&this->head, next);
+	return true;
 }
 
-// Remove queued sound.
-void ng::Channel::remove_sound (size_t sound) {
-	if (this->queue.size() == 0 || sound < 0 || sound >= this->queue.size()) {
-		return;
+// Consumer. Returns false if queue is empty.
+bool ng::CommandQueue::pop (Command* const command) {
+	int tail = SDL_AtomicGet(&this->tail);
+	if (tail == SDL_AtomicGet(&this->head)) {
+		return false;
 	}
-	this->queue.erase(this->queue.begin()+sound);
+	*command = this->buffer[tail];
+	SDL_AtomicSet(&this->tail, (tail + 1) % static_cast<int>(this->buffer.size()));
+	return true;
 }
 
-// Remove all queued sounds.
-void ng::Channel::stop () {
-	this->queue.clear();
+ng::MixPool::MixPool () {
+	this->start = NULL;
+	this->done = NULL;
+	SDL_AtomicSet(&this->running, 0);
+	SDL_AtomicSet(&this->next, 0);
+	this->jobs = NULL;
+	this->count = 0;
+	SDL_zero(this->spec);
+	this->samples = 0;
+	this->frame = 0;
 }
 
-// Allocate samples for buffer and fill with silence.
-void ng::Channel::clear (size_t samples) {
-	this->buffer.clear();
-	for (size_t i=0; i < samples; i++) {
-		this->buffer.push_back(ng::dB_silence());
+ng::MixPool::~MixPool () {
+	this->close();
+}
+
+// Worker thread. Mix a batch each time start is posted.
+static int mix_pool_thread (void* data) {
+	ng::MixPool* pool = static_cast<ng::MixPool*>(data);
+	while (true) {
+		SDL_SemWait(pool->start);
+		if (SDL_AtomicGet(&pool->running) == 0) {
+			return 0;
+		}
+		pool->work();
+		SDL_SemPost(pool->done);
 	}
 }
 
-// Mix samples from sound clip into channel buffer.
-int ng::Channel::mix_sound (size_t sound) {
-	Clip* clip = this->queue[sound].clip;
-	size_t s = this->queue[sound].sample;
-	
-	switch (this->queue[sound].mode) {
-		case ng::SoundPlayOnce: {
-			for (size_t i=0; i < this->buffer.size(); i++) {
-				this->buffer[i] = ng::mix_dB(this->buffer[i], clip->buffer[s]);
-				s++;
-				// Returns ng::SoundComplete if sound completes during the mix.
-				if (s == clip->buffer.size()) {
-					this->queue[sound].mode = ng::SoundComplete;
-					this->queue[sound].sample = s;
-					return ng::SoundComplete;
-				}
-			}
-			break;
-			
-		} case ng::SoundLoop: {
-			for (size_t i=0; i < this->buffer.size(); i++) {
-				this->buffer[i] = ng::mix_dB(this->buffer[i], clip->buffer[s]);
-				s++;
-				if (s == clip->buffer.size()) {
-					s = 0;
-				}
-			}
-			break;
+// Start worker threads. Closes any running workers first.
+void ng::MixPool::open (int workers) {
+	if (workers < 0) {
+		throw std::logic_error("workers must be >= 0");
+	}
+	this->close();
+	if (workers == 0) {
+		return;
+	}
+	this->start = SDL_CreateSemaphore(0);
+	this->done = SDL_CreateSemaphore(0);
+	if (this->start == NULL || this->done == NULL) {
+		std::runtime_error error(SDL_GetError());
+		this->close();
+		throw error;
+	}
+	SDL_AtomicSet(&this->running, 1);
+	for (int i=0; i < workers; i++) {
+		SDL_Thread* thread = SDL_CreateThread(mix_pool_thread, "ng::MixPool", this);
+		if (thread == NULL) {
+			std::runtime_error error(SDL_GetError());
+			this->close();
+			throw error;
 		}
+		this->threads.push_back(thread);
+	}
+}
+
+// Stop and join worker threads.
+void ng::MixPool::close () {
+	SDL_AtomicSet(&this->running, 0);
+	for (size_t i=0; i < this->threads.size(); i++) {
+		SDL_SemPost(this->start);
+	}
+	for (size_t i=0; i < this->threads.size(); i++) {
+		SDL_WaitThread(this->threads[i], NULL);
+	}
+	this->threads.clear();
+	if (this->start != NULL) {
+		SDL_DestroySemaphore(this->start);
+		this->start = NULL;
+	}
+	if (this->done != NULL) {
+		SDL_DestroySemaphore(this->done);
+		this->done = NULL;
 	}
+}
+
+// Clear and mix count channels, each with spec and samples, for the buffer
+// starting on audio timeline frame. Blocks.
+void ng::MixPool::mix (Channel* const* channels, size_t count, const SDL_AudioSpec& spec,
+size_t samples, uint64_t frame) {
+	this->jobs = channels;
+	this->count = count;
+	this->spec = spec;
+	this->samples = samples;
+	this->frame = frame;
+	SDL_AtomicSet(&this->next, 0);
 	
-	this->queue[sound].sample = s;
-	return ng::None;
+	// Wake only as many workers as there are channels for, besides this thread.
+	size_t wake = this->threads.size();
+	if (count < wake + 1) {
+		wake = (count > 0) ? count - 1 : 0;
+	}
+	for (size_t i=0; i < wake; i++) {
+		SDL_SemPost(this->start);
+	}
+	this->work();
+	// Semaphores order memory, so channel buffers are complete after the waits.
+	for (size_t i=0; i < wake; i++) {
+		SDL_SemWait(this->done);
+	}
+	this->jobs = NULL;
+	this->count = 0;
 }
 
-// Mix sounds into channel buffer.
-void ng::Channel::mix () {
-	for (size_t i=0; i < this->queue.size();) {
-		if (this->mix_sound(i) == ng::SoundComplete) {
-			this->remove_sound(i);
-		} else {
-			i++;
+// Mix channels until none are left.
+void ng::MixPool::work () {
+	while (true) {
+		size_t i = static_cast<size_t>(SDL_AtomicAdd(&this->next, 1));
+		if (i >= this->count) {
+			return;
 		}
+		Channel* c = this->jobs[i];
+		c->spec = this->spec;
+		c->frame = this->frame;
+		c->clear(this->samples);
+		c->mix();
 	}
 }
 
+// SDL audio callback, on the audio thread.
+static void audio_callback (void* userdata, uint8_t* stream, int len) {
+	static_cast<ng::Audio*>(userdata)->mix_stream(stream, len);
+}
+
+ng::AudioStats::AudioStats () {
+	this->reset();
+}
+
+ng::AudioStats::~AudioStats () {}
+
+void ng::AudioStats::reset () {
+	this->queued_ms = 0.0;
+	this->latency_ms = 0.0;
+	this->min_queued_ms = 0.0;
+	this->max_queued_ms = 0.0;
+	this->mix_ms = 0.0;
+	this->voices = 0;
+	this->buffers = 0;
+	this->underruns = 0;
+	this->dropped = 0;
+}
+
+// Milliseconds between two performance counters.
+static double counter_ms (uint64_t start, uint64_t end) {
+	return static_cast<double>(end - start) * 1000.0 /
+		static_cast<double>(SDL_GetPerformanceFrequency());
+}
+
 ng::Audio::Audio () {
+	this->mix_start = 0;
+	this->play_end = 0;
+	this->play_queued = 0;
+	this->target_ms = 40;
+	this->tolerance_ms = 10;
+	this->frame_ms = 0.0;
 	this->device = 0;
+	this->mode = ng::AudioQueue;
 	this->volume = 1.0f;
 	this->playing = false;
+	this->frame = 0;
+	this->clear_rem = 0;
 }
 
 ng::Audio::~Audio () {}
 
-// Open audio device in a paused state.
+// Open audio device in a paused state, in queue mode.
 void ng::Audio::open () {
+	this->open(ng::AudioQueue);
+}
+
+// Open audio device in a paused state, with EnumAudioMode mode.
+void ng::Audio::open (int mode) {
+	if (mode == ng::AudioOffline) {
+		// No device. Use the spec a device would most likely give.
+		SDL_zero(this->spec);
+		this->spec.freq = 44100;
+		this->spec.format = AUDIO_F32SYS;
+		this->spec.channels = 2;
+		this->spec.samples = 4096;
+		this->device = 0;
+		this->mode = mode;
+		this->output.clear();
+		this->clear_rem = 0;
+		return;
+	}
+	
 	SDL_AudioSpec desired, obtained;
+	SDL_zero(desired);
 	desired.freq = 44100;
 	desired.format = AUDIO_F32SYS;
-	desired.samples = 4096;
 	desired.channels = 2;
-	desired.callback = NULL;
+	if (mode == ng::AudioCallback) {
+		// The device pulls audio as needed, so latency can be one small chunk.
+		desired.samples = 1024;
+		desired.callback = audio_callback;
+		desired.userdata = this;
+	} else {
+		// The device pulls a chunk from the queue at a time, so the chunk must be
+		// well under target_ms.
+		desired.samples = 1024;
+		desired.callback = NULL;
+	}
 	int allowed_changes =
 		static_cast<int>(SDL_AUDIO_ALLOW_FREQUENCY_CHANGE) |
 		static_cast<int>(SDL_AUDIO_ALLOW_CHANNELS_CHANGE) |
@@ -180,98 +1937,616 @@ void ng::Audio::open () {
 	}
 	
 	this->spec = obtained;
+	this->mode = mode;
+	
+	if (mode == ng::AudioCallback) {
+		// Allocate everything the audio thread needs now, so it never allocates.
+		size_t samples = static_cast<size_t>(this->spec.samples) *
+			static_cast<size_t>(this->spec.channels);
+		this->buffer.reserve(samples);
+		this->commands.reset(256);
+	}
+}
+
+// Mix channels on worker threads, plus the calling thread.
+void ng::Audio::set_workers (int workers) {
+	if (this->mode == ng::AudioCallback && this->playing) {
+		throw std::logic_error("set_workers in callback mode needs to be before play");
+	}
+	this->pending.clear();
+	this->pool.open(workers);
+}
+
+// Set device queue depth to keep, in ms, and how far it may drift.
+void ng::Audio::set_latency (int target_ms, int tolerance_ms) {
+	if (target_ms <= 0 || tolerance_ms < 0) {
+		throw std::logic_error("latency target must be > 0, and tolerance >= 0");
+	}
+	this->target_ms = target_ms;
+	this->tolerance_ms = tolerance_ms;
+}
+
+// Give channel to the audio thread, to be mixed every callback.
+void ng::Audio::add_channel (Channel* c) {
+	if (this->mode != ng::AudioCallback || this->playing) {
+		throw std::logic_error("add_channel needs callback mode, before play");
+	}
+	if (!this->has_bus(c->bus)) {
+		throw std::logic_error("channel bus must be added with add_bus");
+	}
+	size_t samples = static_cast<size_t>(this->spec.samples) *
+		static_cast<size_t>(this->spec.channels);
+	c->buffer.reserve(samples);
+	for (size_t i=0; i < c->effects.size(); i++) {
+		c->effects[i]->prepare(this->spec);
+	}
+	this->channels.push_back(c);
+}
+
+// Add bus, mixed into parent bus, or into buffer if parent is NULL.
+void ng::Audio::add_bus (Bus* bus, Bus* parent) {
+	if (this->mode == ng::AudioCallback && this->playing) {
+		throw std::logic_error("add_bus needs to be before play in callback mode");
+	}
+	if (!this->has_bus(parent)) {
+		throw std::logic_error("add_bus parent must be added first");
+	}
+	bus->parent = parent;
+	bus->buffer.reserve(this->buffer.capacity());
+	this->buses.push_back(bus);
+}
+
+// Queue a sound with EnumSound mode on channel.
+void ng::Audio::play_sound (Channel* c, Clip* clip, int mode) {
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.clip = clip;
+	command.sound = mode;
+	this->send(command);
+}
+
+void ng::Audio::play_sound (Channel* c, Clip* clip, int mode, int priority, float volume) {
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.clip = clip;
+	command.sound = mode;
+	command.priority = priority;
+	command.volume = volume;
+	this->send(command);
+}
+
+// Queue a stream with EnumSound mode on channel.
+void ng::Audio::play_sound (Channel* c, Stream* stream, int mode) {
+	// Checked here too, since the audio thread can only drop the sound.
+	if (SDL_AtomicGet(&stream->used) != 0) {
+		throw std::logic_error("stream is already playing");
+	}
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.stream = stream;
+	command.sound = mode;
+	this->send(command);
+}
+
+// Queue a sound or stream on channel, to start exactly on audio timeline frame.
+void ng::Audio::play_sound_at (Channel* c, Clip* clip, int mode, uint64_t frame) {
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.clip = clip;
+	command.sound = mode;
+	command.frame = frame;
+	this->send(command);
+}
+
+void ng::Audio::play_sound_at (Channel* c, Clip* clip, int mode, int priority, float volume,
+uint64_t frame) {
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.clip = clip;
+	command.sound = mode;
+	command.priority = priority;
+	command.volume = volume;
+	command.frame = frame;
+	this->send(command);
+}
+
+void ng::Audio::play_sound_at (Channel* c, Stream* stream, int mode, uint64_t frame) {
+	if (SDL_AtomicGet(&stream->used) != 0) {
+		throw std::logic_error("stream is already playing");
+	}
+	Command command;
+	command.mode = ng::CommandPlaySound;
+	command.channel = c;
+	command.stream = stream;
+	command.sound = mode;
+	command.frame = frame;
+	this->send(command);
+}
+
+// Audio timeline frame being heard now.
+uint64_t ng::Audio::now () {
+	if (this->mode == ng::AudioOffline || this->device == 0) {
+		return this->frame;
+	}
+	if (this->mode == ng::AudioCallback) {
+		// The last callback's chunk is what the device is playing.
+		SDL_LockAudioDevice(this->device);
+		uint64_t frame = this->frame;
+		SDL_UnlockAudioDevice(this->device);
+		uint64_t chunk = static_cast<uint64_t>(this->spec.samples);
+		return (frame > chunk) ? frame - chunk : 0;
+	}
+	uint64_t queued = SDL_GetQueuedAudioSize(this->device) /
+		(sizeof(float) * static_cast<size_t>(this->spec.channels));
+	return (this->frame > queued) ? this->frame - queued : 0;
+}
+
+// Remove all queued sounds on channel.
+void ng::Audio::stop (Channel* c) {
+	Command command;
+	command.mode = ng::CommandStop;
+	command.channel = c;
+	this->send(command);
+}
+
+// Set channel volume.
+void ng::Audio::set_volume (Channel* c, float volume) {
+	Command command;
+	command.mode = ng::CommandChannelVolume;
+	command.channel = c;
+	command.volume = volume;
+	this->send(command);
+}
+
+// Set bus volume.
+void ng::Audio::set_volume (Bus* bus, float volume) {
+	Command command;
+	command.mode = ng::CommandBusVolume;
+	command.bus = bus;
+	command.volume = volume;
+	this->send(command);
+}
+
+// Set audio volume.
+void ng::Audio::set_volume (float volume) {
+	Command command;
+	command.mode = ng::CommandVolume;
+	command.volume = volume;
+	this->send(command);
+}
+
+// Change a mixed effect to the mode and settings of another effect.
+void ng::Audio::set_effect (Effect* effect, const Effect& settings) {
+	if (settings.mode == ng::EffectDelay && effect->spec_freq != 0) {
+		size_t frames = static_cast<size_t>(settings.delay_ms *
+			static_cast<float>(effect->spec_freq) / 1000.0f);
+		if (frames == 0) {
+			frames = 1;
+		}
+		if (frames * static_cast<size_t>(effect->spec_channels) > effect->line.size()) {
+			throw std::logic_error("set_effect delay is longer than when prepared");
+		}
+	}
+	Command command;
+	command.mode = ng::CommandEffect;
+	command.effect = effect;
+	command.effect_mode = settings.mode;
+	settings.get_settings(command.settings);
+	this->send(command);
+}
+
+// Act now in queue mode, or push command in callback mode.
+void ng::Audio::send (const Command& command) {
+	if (this->mode != ng::AudioCallback) {
+		this->run(command);
+		return;
+	}
+	if (!this->commands.push(command)) {
+		throw std::runtime_error("audio command queue full");
+	}
+}
+
+// Act on a command.
+void ng::Audio::run (const Command& command) {
+	switch (command.mode) {
+		case ng::CommandPlaySound: {
+			if (command.stream != NULL) {
+				command.channel->play_sound_at(command.stream, command.sound,
+					command.frame);
+			} else {
+				command.channel->play_sound_at(command.clip, command.sound,
+					command.priority, command.volume, command.frame);
+			}
+			break;
+		} case ng::CommandStop: {
+			command.channel->stop();
+			break;
+		} case ng::CommandChannelVolume: {
+			command.channel->volume = command.volume;
+			break;
+		} case ng::CommandBusVolume: {
+			command.bus->volume = command.volume;
+			break;
+		} case ng::CommandVolume: {
+			this->volume = command.volume;
+			break;
+		} case ng::CommandEffect: {
+			command.effect->apply_settings(command.effect_mode, command.settings);
+			break;
+		}
+	}
+}
+
+// Run commands, then mix channels into stream.
+void ng::Audio::mix_stream (uint8_t* stream, int bytes) {
+	this->mix_start = SDL_GetPerformanceCounter();
+	this->stats.voices = 0;
+	Command command;
+	while (this->commands.pop(&command)) {
+		this->run(command);
+	}
+	
+	// Buffers were reserved at open, add_bus, and add_channel, so assign
+	// does not allocate.
+	size_t samples = static_cast<size_t>(bytes) / sizeof(float);
+	this->buffer.assign(samples, 0.0f);
+	this->clear_buses();
+	if (this->pool.threads.empty()) {
+		for (size_t i=0; i < this->channels.size(); i++) {
+			this->mix_channel_buffer(this->channels[i]);
+		}
+	} else {
+		this->pool.mix(this->channels.data(), this->channels.size(), this->spec, samples,
+			this->frame);
+		for (size_t i=0; i < this->channels.size(); i++) {
+			this->add_channel_buffer(this->channels[i]);
+		}
+	}
+	this->mix_buses();
+	ng::mix_gain(this->buffer.data(), ng::volume_to_amp(this->volume), samples);
+	ng::mix_clamp(this->buffer.data(), -1.0f, 1.0f, samples);
+	SDL_memcpy(stream, this->buffer.data(), samples * sizeof(float));
+	this->frame += samples / static_cast<size_t>(this->spec.channels);
+	
+	// Device pulls one chunk at a time, so queue depth is the chunk.
+	this->stats.queued_ms = static_cast<double>(this->spec.samples) * 1000.0 /
+		static_cast<double>(this->spec.freq);
+	this->stats.min_queued_ms = this->stats.queued_ms;
+	this->stats.max_queued_ms = this->stats.queued_ms;
+	this->stats.mix_ms = counter_ms(this->mix_start, SDL_GetPerformanceCounter());
+	this->stats.buffers++;
+	
+	// Mixing longer than the chunk plays means the device ran dry meanwhile.
+	if (this->stats.mix_ms > this->stats.queued_ms) {
+		double samples_per_s = static_cast<double>(this->spec.freq) *
+			static_cast<double>(this->spec.channels);
+		this->stats.underruns++;
+		this->stats.dropped += static_cast<int64_t>((this->stats.mix_ms -
+			this->stats.queued_ms) * samples_per_s / 1000.0);
+	}
+}
+
+// Copy of stats, safe to call from game thread in any mode.
+ng::AudioStats ng::Audio::get_stats () {
+	if (this->mode != ng::AudioCallback || this->device == 0) {
+		return this->stats;
+	}
+	// Audio thread writes stats while it holds the device lock.
+	SDL_LockAudioDevice(this->device);
+	AudioStats stats = this->stats;
+	SDL_UnlockAudioDevice(this->device);
+	return stats;
 }
 
 // Free buffer and close audio device.
 void ng::Audio::close () {
-	SDL_ClearQueuedAudio(this->device);
-	SDL_CloseAudioDevice(this->device);
+	// Offline mode has no device, but still has workers and a timeline.
+	if (this->device != 0) {
+		SDL_ClearQueuedAudio(this->device);
+		SDL_CloseAudioDevice(this->device);
+		this->device = 0;
+	}
+	this->pool.close();
+	this->playing = false;
+	this->frame = 0;
+	this->clear_rem = 0;
+}
+
+// Write output to a .wav file, as float32 at spec rate.
+void ng::Audio::save (const char* file) {
+	// RIFF sizes are 32-bit, and the header adds 36 bytes to the samples.
+	if (static_cast<uint64_t>(this->output.size()) * sizeof(float) > 0xFFFFFFFFu - 36) {
+		throw std::logic_error("audio output is too big for a wav file");
+	}
+	SDL_RWops* rw = SDL_RWFromFile(file, "wb");
+	if (rw == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	
+	uint32_t channels = static_cast<uint32_t>(this->spec.channels);
+	uint32_t freq = static_cast<uint32_t>(this->spec.freq);
+	uint32_t data_bytes = static_cast<uint32_t>(this->output.size() * sizeof(float));
+	bool ok =
+		SDL_WriteLE32(rw, 0x46464952) == 1 && // "RIFF"
+		SDL_WriteLE32(rw, 36 + data_bytes) == 1 &&
+		SDL_WriteLE32(rw, 0x45564157) == 1 && // "WAVE"
+		SDL_WriteLE32(rw, 0x20746d66) == 1 && // "fmt "
+		SDL_WriteLE32(rw, 16) == 1 &&
+		SDL_WriteLE16(rw, 3) == 1 && // float
+		SDL_WriteLE16(rw, static_cast<uint16_t>(channels)) == 1 &&
+		SDL_WriteLE32(rw, freq) == 1 &&
+		SDL_WriteLE32(rw, freq * channels * sizeof(float)) == 1 &&
+		SDL_WriteLE16(rw, static_cast<uint16_t>(channels * sizeof(float))) == 1 &&
+		SDL_WriteLE16(rw, 32) == 1 &&
+		SDL_WriteLE32(rw, 0x61746164) == 1 && // "data"
+		SDL_WriteLE32(rw, data_bytes) == 1;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+	if (ok && this->output.size() > 0) {
+		ok = SDL_RWwrite(rw, this->output.data(), data_bytes, 1) == 1;
+	}
+#else
+	for (size_t i=0; ok && i < this->output.size(); i++) {
+		uint32_t x;
+		SDL_memcpy(&x, &this->output[i], sizeof(x));
+		ok = SDL_WriteLE32(rw, x) == 1;
+	}
+#endif
+	SDL_RWclose(rw);
+	if (!ok) {
+		throw std::runtime_error("can't write audio file");
+	}
 }
 
 // Allocate at least ms of samples for buffer and fill with silence.
 void ng::Audio::clear (int ms) {
-	int queue_bytes, queue_samples;
+	// In callback mode, buffer belongs to the audio thread.
+	if (this->mode == ng::AudioCallback) {
+		return;
+	}
+	
+	this->pending.clear();
+	uint64_t last_clear = this->mix_start;
+	this->mix_start = SDL_GetPerformanceCounter();
+	this->stats.mix_ms = 0.0;
+	this->stats.voices = 0;
+	
+	// In offline mode, makes exactly ms of samples, so renders are repeatable.
+	// The part of a frame that does not fit carries into the next clear, so
+	// output stays in step with the total ms.
+	if (this->mode == ng::AudioOffline) {
+		size_t frames = static_cast<size_t>(this->spec.samples);
+		if (ms > 0) {
+			uint64_t total = static_cast<uint64_t>(ms) *
+				static_cast<uint64_t>(this->spec.freq) + this->clear_rem;
+			frames = static_cast<size_t>(total / 1000);
+			this->clear_rem = total % 1000;
+		}
+		this->buffer.assign(frames * static_cast<size_t>(this->spec.channels), 0.0f);
+		this->clear_buses();
+		return;
+	}
+	
+	int queue_samples;
 	// If playing is false, then does not check audio device.
 	if (this->playing) {
-		queue_bytes = static_cast<int>(SDL_GetQueuedAudioSize(this->device));
-		queue_samples = queue_bytes / sizeof(float);
+		queue_samples = static_cast<int>(SDL_GetQueuedAudioSize(this->device) / sizeof(float));
 	} else {
-		queue_bytes = 0;
 		queue_samples = 0;
 	}
+	this->count_queue(queue_samples);
 	
-	int chunk_samples, samples_per_ms, samples;
-	chunk_samples = this->spec.samples * this->spec.channels;
-	samples_per_ms = this->spec.freq / 1000;
-	// If ms == 0, allocates 1 chunk of (spec.samples * spec.channels) samples.
-	if (ms > 0) {
-		samples = ms * samples_per_ms;
+	// Expected time until next clear. Rises to a slow frame at once, so the
+	// queue covers it, and falls back slowly.
+	double interval_ms;
+	if (this->playing && last_clear != 0) {
+		interval_ms = counter_ms(last_clear, this->mix_start);
+	} else if (ms > 0) {
+		interval_ms = static_cast<double>(ms);
 	} else {
-		samples = chunk_samples;
+		interval_ms = static_cast<double>(this->spec.samples) * 1000.0 /
+			static_cast<double>(this->spec.freq);
 	}
-	// If the audio device contains more samples than ms would create, then
-	// sets samples = 0 and does nothing to buffer.
-	if (queue_samples >= samples) {
-		this->buffer.clear();
-		return;
+	if (!this->playing || interval_ms > this->frame_ms) {
+		this->frame_ms = interval_ms;
+	} else {
+		this->frame_ms += (interval_ms - this->frame_ms) / 8.0;
 	}
 	
-	// Samples is a multiple of (spec.samples * spec.channels) chunks, and
-	// takes into account the number of samples already in audio device.
-	samples -= queue_samples;
-	int chunks = (samples / chunk_samples) + 1;
-	samples = chunks * chunk_samples;
+	// Mix one frame, plus a correction toward target. Outside tolerance, correct
+	// all of the error, inside it a quarter, so the queue settles without jumps.
+	double queued_ms = static_cast<double>(queue_samples) * 1000.0 /
+		static_cast<double>(this->spec.freq * this->spec.channels);
+	double error_ms = static_cast<double>(this->target_ms) - queued_ms;
+	double mix_ms = this->frame_ms;
+	if (error_ms > this->tolerance_ms || error_ms < -this->tolerance_ms) {
+		mix_ms += error_ms;
+	} else {
+		mix_ms += error_ms / 4.0;
+	}
 	
-	this->buffer.clear();
-	for (size_t i=0; i < static_cast<size_t>(samples); i++) {
-		this->buffer.push_back(ng::dB_silence());
+	// Whole frames, not chunks. If queue is already deep enough, mixes nothing.
+	size_t frames = 0;
+	if (mix_ms > 0.0) {
+		frames = static_cast<size_t>(mix_ms * static_cast<double>(this->spec.freq) / 1000.0);
 	}
+	if (frames == 0) {
+		this->buffer.clear();
+		return;
+	}
+	
+	// Silence is 0 in linear amplitude. Keeps capacity between calls.
+	this->buffer.assign(frames * static_cast<size_t>(this->spec.channels), 0.0f);
+	this->clear_buses();
 }
 
 // Clear channel, mix sounds, and mix channel buffer.
 void ng::Audio::mix_channel (Channel* c) {
-	// Does nothing if samples == 0.
-	if (this->buffer.size() == 0) {
+	// Does nothing if samples == 0, or in callback mode.
+	if (this->mode == ng::AudioCallback || this->buffer.size() == 0) {
+		return;
+	}
+	if (!this->has_bus(c->bus)) {
+		throw std::logic_error("channel bus must be added with add_bus");
+	}
+	if (this->pool.threads.empty()) {
+		this->mix_channel_buffer(c);
+	} else {
+		// Game thread only. Clear keeps capacity, so this grows only while the
+		// number of channels mixed per buffer does.
+		this->pending.push_back(c);
+	}
+}
+
+// Update queue depth and underrun counters, given samples in device queue.
+void ng::Audio::count_queue (int queue_samples) {
+	if (!this->playing) {
 		return;
 	}
+	int samples_per_s = this->spec.freq * this->spec.channels;
+	double queued_ms = static_cast<double>(queue_samples) * 1000.0 /
+		static_cast<double>(samples_per_s);
+	this->stats.queued_ms = queued_ms;
+	if (this->stats.buffers == 0 || queued_ms < this->stats.min_queued_ms) {
+		this->stats.min_queued_ms = queued_ms;
+	}
+	if (queued_ms > this->stats.max_queued_ms) {
+		this->stats.max_queued_ms = queued_ms;
+	}
 	
+	// Device ran dry. Samples it needed since last play, minus samples it had,
+	// were played as silence.
+	if (queue_samples == 0) {
+		this->stats.underruns++;
+		double elapsed_ms = counter_ms(this->play_end, this->mix_start);
+		int64_t needed = static_cast<int64_t>(elapsed_ms * samples_per_s / 1000.0);
+		if (needed > this->play_queued) {
+			this->stats.dropped += needed - this->play_queued;
+		}
+	}
+}
+
+// Clear channel, mix sounds, and mix channel buffer into its bus.
+void ng::Audio::mix_channel_buffer (Channel* c) {
+	c->spec = this->spec;
+	c->frame = this->frame;
 	c->clear(this->buffer.size()); // Channel samples = samples.
 	c->mix();
+	this->add_channel_buffer(c);
+}
+
+// Mix channel buffer, already mixed, into its bus.
+void ng::Audio::add_channel_buffer (Channel* c) {
+	this->stats.voices += static_cast<int>(c->mixed);
 	
-	float dv = ng::dB_volume(c->volume);
-	for (size_t i=0; i < this->buffer.size(); i++) {
-		c->buffer[i] *= dv;
-		this->buffer[i] = ng::mix_dB(this->buffer[i], c->buffer[i] * dv);
+	// Volume becomes gain once per buffer, so mixing a sample is a multiply-add.
+	float gain = ng::volume_to_amp(c->volume);
+	float* dest = this->buffer.data();
+	// A bus is sized by clear_buses only if it was added. Routing checks that,
+	// so this only guards the audio thread against a bus changed later.
+	if (c->bus != NULL && c->bus->buffer.size() == this->buffer.size()) {
+		dest = c->bus->buffer.data();
+	}
+	ng::mix_add_gain(dest, c->buffer.data(), gain, this->buffer.size());
+}
+
+// True if bus is NULL or was added with add_bus.
+bool ng::Audio::has_bus (const Bus* bus) const {
+	if (bus == NULL) {
+		return true;
+	}
+	for (size_t i=0; i < this->buses.size(); i++) {
+		if (this->buses[i] == bus) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Mix pending channels on the pool, then add them up in order.
+void ng::Audio::mix_pending () {
+	if (this->pending.empty()) {
+		return;
+	}
+	this->pool.mix(this->pending.data(), this->pending.size(), this->spec,
+		this->buffer.size(), this->frame);
+	// Same order as mix_channel calls, so the sum is the same on every run.
+	for (size_t i=0; i < this->pending.size(); i++) {
+		this->add_channel_buffer(this->pending[i]);
+	}
+	this->pending.clear();
+}
+
+// Fill bus buffers with silence, the same size as buffer.
+void ng::Audio::clear_buses () {
+	for (size_t i=0; i < this->buses.size(); i++) {
+		this->buses[i]->buffer.assign(this->buffer.size(), 0.0f);
+	}
+}
+
+// Mix each bus into its parent, children first.
+void ng::Audio::mix_buses () {
+	// Parents are added before children, so the reverse of buses is a
+	// topological order, and each bus is complete before it is mixed.
+	for (size_t i=this->buses.size(); i > 0; i--) {
+		Bus* bus = this->buses[i-1];
+		float* dest = this->buffer.data();
+		if (bus->parent != NULL) {
+			dest = bus->parent->buffer.data();
+		}
+		float gain = ng::volume_to_amp(bus->volume);
+		ng::mix_add_gain(dest, bus->buffer.data(), gain, this->buffer.size());
 	}
 }
 
-// Send buffer to audio device and set playing to true.
+// Mix buses, apply volume to buffer, send buffer to audio device, and set playing to true.
 void ng::Audio::play () {
+	// In callback mode, the audio thread mixes and plays. Only unpause.
+	if (this->mode == ng::AudioCallback) {
+		if (!this->playing) {
+			SDL_PauseAudioDevice(this->device, 0);
+			this->playing = true;
+		}
+		return;
+	}
+	
 	// Does nothing if samples == 0.
 	if (this->buffer.size() == 0) {
 		return;
 	}
 	
-	// Send buffer in chunks of spec.samples * spec.channels.
-	int chunk_samples, chunks, chunk_bytes;
-	chunk_samples = static_cast<int>(this->spec.samples) *
-		static_cast<int>(this->spec.channels);
-	chunks = static_cast<int>(this->buffer.size()) / chunk_samples;
-	chunk_bytes = chunk_samples * sizeof(float);
+	this->mix_pending();
+	this->mix_buses();
 	
-	float dv = ng::dB_volume(this->volume);
-	float* chunk = static_cast<float*>(std::malloc(chunk_bytes));
-	for (int i=0; i < chunks; i++) {
-		for (int f=0; f < chunk_samples; f++) {
-			chunk[f] = this->buffer[(i * chunk_samples) + f] * dv;
-		}
-		int result = SDL_QueueAudio(this->device, chunk, static_cast<uint32_t>(chunk_bytes));
-		if (result != 0) {
-			std::free(chunk);
-			throw std::runtime_error(SDL_GetError());
-		}
+	// Apply volume and clamp in place, then send the whole buffer at once.
+	float gain = ng::volume_to_amp(this->volume);
+	ng::mix_gain(this->buffer.data(), gain, this->buffer.size());
+	ng::mix_clamp(this->buffer.data(), -1.0f, 1.0f, this->buffer.size());
+	this->frame += this->buffer.size() / static_cast<size_t>(this->spec.channels);
+	
+	// In offline mode, append to output instead of a device.
+	if (this->mode == ng::AudioOffline) {
+		this->output.insert(this->output.end(), this->buffer.begin(), this->buffer.end());
+		this->playing = true;
+		this->stats.mix_ms = counter_ms(this->mix_start, SDL_GetPerformanceCounter());
+		this->stats.buffers++;
+		return;
+	}
+	
+	uint32_t bytes = static_cast<uint32_t>(this->buffer.size() * sizeof(float));
+	if (SDL_QueueAudio(this->device, this->buffer.data(), bytes) != 0) {
+		throw std::runtime_error(SDL_GetError());
 	}
-	std::free(chunk);
+	this->play_end = SDL_GetPerformanceCounter();
+	this->play_queued = static_cast<int64_t>(SDL_GetQueuedAudioSize(this->device) / sizeof(float));
+	this->stats.latency_ms = static_cast<double>(this->play_queued) * 1000.0 /
+		static_cast<double>(this->spec.freq * this->spec.channels);
+	this->stats.mix_ms = counter_ms(this->mix_start, this->play_end);
+	this->stats.buffers++;
 	
 	// The first call to play sets playing to true and unpauses audio device.
 	if (!this->playing) {
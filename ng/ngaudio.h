@@ -14,23 +14,177 @@ namespace ng {
 		SoundComplete = 3
 	};
 	
+	enum EnumSteal {
+		StealOldest = 1,
+		StealQuietest = 2
+	};
+	
+	enum EnumResample {
+		ResampleLinear = 1,
+		ResampleCubic = 2
+	};
+	
+	enum EnumEffect {
+		EffectLowPass = 1, // biquad
+		EffectHighPass = 2, // biquad
+		EffectDelay = 3, // echo with feedback
+		EffectCompressor = 4,
+		EffectLimiter = 5 // compressor with infinite ratio and instant attack
+	};
+	
+	enum EnumAudioMode {
+		AudioQueue = 1, // game thread mixes, then queues audio to device
+		AudioCallback = 2, // audio thread mixes when device needs more audio
+		AudioOffline = 3 // no device, play appends to output as fast as cpu allows
+	};
+	
+	enum EnumCommand {
+		CommandPlaySound = 1,
+		CommandStop = 2,
+		CommandChannelVolume = 3,
+		CommandVolume = 4,
+		CommandBusVolume = 5,
+		CommandEffect = 6
+	};
+	
+	// Mixing kernels over float samples, in linear amplitude.
+	// Each call picks AVX2, SSE2, or scalar code once, at runtime.
+	// dest += src
+	void mix_add (float* dest, const float* src, size_t n);
+	// dest += src * gain
+	void mix_add_gain (float* dest, const float* src, float gain, size_t n);
+	// dest *= gain
+	void mix_gain (float* dest, float gain, size_t n);
+	// dest = clamp(dest, min, max)
+	void mix_clamp (float* dest, float min, float max, size_t n);
+	
+	// Audio clip, stored with its own rate and channels (mono or stereo).
+	// 16-bit samples stay int16, and anything else is float32.
+	// The mixer converts and resamples while it mixes.
 	class Clip {
 	public:
-		SDL_AudioSpec spec;
-		std::vector<float> buffer;
+		SDL_AudioSpec spec; // format is AUDIO_S16SYS or AUDIO_F32SYS
+		std::vector<uint8_t> buffer; // interleaved samples, in spec.format
+		const uint8_t* data; // samples, in buffer or in a mapped baked file
+		size_t frames; // samples per channel
+		size_t bytes; // size of samples, set by load
+		double load_ms; // time taken by load
+		void* mapped; // baked file mapped by map, or NULL
+		size_t mapped_bytes;
 		
 		Clip ();
 		~Clip ();
 		
-		// Load .wav file into buffer, with same spec as audio device.
+		// Copy samples into this clip's own buffer, even from a mapped clip,
+		// so the copy does not point into, or unmap, the other clip's memory.
+		Clip (const Clip& clip);
+		Clip& operator= (const Clip& clip);
+		
+		// Load .wav file into buffer, with its own rate and channels.
+		// If it throws, the clip keeps its old samples.
+		void load (const char* file);
+		void load (Audio*, const char* file);
+		
+		// Bake clip to a file that map loads with no decoding or copying:
+		// a 32 byte header, then samples exactly as in memory.
+		void save (const char* file);
+		
+		// Map a baked file, and point data at its samples. Read-only.
+		// Throws runtime_error if the file was baked on a machine with
+		// a different byte order.
+		void map (const char* file);
+		
+		// Internal. Called by load, map, and destructor.
+		// Unmap baked file, if any.
+		void unmap ();
+	};
+	
+	// Streaming clip, for long music tracks.
+	// A decoder thread reads and converts the .wav file in small chunks into a
+	// ring buffer, so memory stays bounded no matter how long the track is.
+	class Stream {
+	public:
+		SDL_AudioSpec spec; // same as audio device
+		SDL_RWops* file;
+		SDL_AudioStream* convert;
+		int64_t data_start; // file offset of samples
+		int64_t data_bytes;
+		int64_t data_left; // bytes not yet read this pass
+		
+		// Lock-free ring of converted samples.
+		// Decoder thread is the only producer, and mixer the only consumer.
+		std::vector<float> ring; // linear amplitude
+		SDL_atomic_t head; // written by decoder only
+		SDL_atomic_t tail; // written by mixer only
+		std::vector<float> chunk; // decoder scratch
+		
+		SDL_Thread* thread;
+		SDL_atomic_t running;
+		SDL_atomic_t loop; // at end of file, start again instead of ending
+		SDL_atomic_t ended; // decoder converted the last sample
+		SDL_atomic_t used; // 1 while a channel voice plays it, so the ring has one consumer
+		bool wait; // offline mode, mix waits for the decoder instead of leaving a gap
+		
+		Stream ();
+		~Stream ();
+		
+		// Open .wav file and start decoding, with same spec as audio device.
+		// Throws runtime_error if the file has no samples. A looping stream whose
+		// file turns out shorter than its header ends instead of looping.
 		void load (Audio*, const char* file);
+		
+		// Stop decoding and close file.
+		void close ();
+		
+		// Stop decoding, and start again from the first sample.
+		// Do not call while a channel is playing this stream.
+		void rewind ();
+		
+		// Samples converted and not yet mixed.
+		size_t available () const;
+		
+		// True when every sample has been mixed, and the stream is not looping.
+		bool done () const;
+		
+		// Internal. Called by channel::mix_sound.
+		// Mix up to n converted samples times gain into dest. Returns samples mixed.
+		// In offline mode, waits until n samples are mixed or the stream is done,
+		// so every render is the same.
+		size_t mix (float* dest, float gain, size_t n);
+		
+		// Internal. Called by mix.
+		// Mix up to n samples that are ready now. Returns samples mixed.
+		size_t mix_ready (float* dest, float gain, size_t n);
+		
+		// Internal. Called by load and rewind.
+		// Start decoder thread.
+		void start ();
+		
+		// Internal. Called by decoder thread.
+		// Fill ring until stream is closed.
+		void decode ();
 	};
 	
+	// Clip render kernel, compiled for one sample format, clip channels, loop
+	// mode, resampler, and device channels.
+	typedef size_t (*RenderClip) (const Clip*, float*, size_t, size_t, uint64_t*,
+		uint64_t, float);
+	
 	class Sound {
 	public:
 		Clip* clip;
-		size_t sample;
+		Stream* stream; // if not NULL, play stream instead of clip
+		size_t sample; // stream samples mixed
+		uint64_t position; // clip frame, in 32.32 fixed point
 		int mode;
+		int priority; // higher priority sounds steal voices from lower
+		float volume; // linear volume [0, 1], see ng::volume_to_amp
+		uint64_t age; // order of play, set by channel::add_sound
+		uint64_t start; // audio timeline frame to start on, 0 for next buffer
+		// Kernel picked when the voice first mixes, or NULL. Picked again only if
+		// render_key (format, channels, resampler, device channels) changes.
+		RenderClip render;
+		uint32_t render_key;
 		
 		Sound ();
 		~Sound ();
@@ -38,24 +192,165 @@ namespace ng {
 		// Internal. Called by channel::add_sound.
 		// Initialize a sound pointing to the start of clip, with EnumSound mode.
 		void set (Clip*, int mode);
+		
+		// Initialize a sound pointing to stream, with EnumSound mode.
+		void set (Stream*, int mode);
+		
+		// Set priority and volume.
+		void set (int priority, float volume);
+		
+		// Set audio timeline frame to start on, 0 for next buffer.
+		void set (uint64_t start);
+	};
+	
+	// Mix bus. Channels and child buses mix into it, and it mixes into its
+	// parent with one volume, so changing a group's volume is O(1).
+	// For example: sfx -> world -> master, and music -> master.
+	class Bus {
+	public:
+		Bus* parent; // NULL mixes into audio buffer (master)
+		std::vector<float> buffer; // linear amplitude
+		float volume; // linear volume [0, 1], see ng::volume_to_amp
+		
+		Bus ();
+		~Bus ();
+	};
+	
+	// Insert effect with EnumEffect mode, run on a whole channel buffer after
+	// its sounds are mixed. Set with one of the set_ methods before it is mixed.
+	// State is sized by prepare, when the channel is added in callback mode, so
+	// the audio thread never allocates. Change a mixed effect with
+	// audio::set_effect.
+	class Effect {
+	public:
+		int mode; // EnumEffect, or ng::None to pass audio through
+		// Biquad
+		float freq; // cutoff, in Hz
+		float q;
+		float b0, b1, b2, a1, a2; // coefficients, divided by a0
+		float z1[2], z2[2]; // transposed direct form II state, per channel
+		// Delay
+		float delay_ms;
+		float feedback; // [0, 1)
+		float wet; // gain of delayed signal in output
+		std::vector<float> line; // linear amplitude, sized by prepare
+		size_t line_samples; // samples of line in use, for delay_ms
+		size_t line_pos;
+		// Compressor and limiter
+		float threshold_dB;
+		float ratio;
+		float attack_ms;
+		float release_ms;
+		float envelope; // peak amplitude
+		float attack, release; // envelope coefficients per block
+		float gain; // gain at the end of the last block, ramped from
+		// Rate and channels state was prepared for, 0 if not yet.
+		int spec_freq;
+		int spec_channels;
+		
+		Effect ();
+		~Effect ();
+		
+		// Low pass or high pass biquad at freq Hz, with q (0.707 is flat).
+		void set_lowpass (float freq, float q);
+		void set_highpass (float freq, float q);
+		
+		// Echo after ms, with feedback [0, 1), and wet gain of the echo.
+		void set_delay (float ms, float feedback, float wet);
+		
+		// Reduce gain above threshold dB by ratio, with attack and release in ms.
+		void set_compressor (float threshold_dB, float ratio, float attack_ms,
+			float release_ms);
+		
+		// Keep peaks at or below threshold dB, with release in ms.
+		void set_limiter (float threshold_dB, float release_ms);
+		
+		// Silence state, such as the delay line and filter history.
+		void reset ();
+		
+		// Internal. Called by audio::add_channel, and by process in queue and
+		// offline mode. Size state for rate and channels, then update. Allocates.
+		void prepare (const SDL_AudioSpec& spec);
+		
+		// Internal. Called by prepare and apply_settings.
+		// Compute coefficients for the prepared rate, without allocating.
+		void update ();
+		
+		// Internal. Called by audio::set_effect.
+		// Settings from the set_ method, in order, up to 4.
+		void get_settings (float* const settings) const;
+		
+		// Internal. Called by the audio thread.
+		// Take mode and settings from get_settings, keeping state.
+		void apply_settings (int mode, const float* settings);
+		
+		// Process frames of interleaved samples in place.
+		void process (float* buffer, size_t frames, const SDL_AudioSpec& spec);
+		
+		// Internal. Called by process.
+		void process_biquad (float* buffer, size_t frames, int channels);
+		void process_delay (float* buffer, size_t frames, int channels);
+		void process_dynamics (float* buffer, size_t frames, int channels);
 	};
 	
 	class Channel {
 	public:
+		Bus* bus; // NULL mixes into audio buffer (master)
+		// Voice pool, allocated once. Sounds [0, sounds) are playing.
 		std::vector<Sound> queue;
-		//size_t sounds;
-		std::vector<float> buffer;
+		size_t sounds;
+		uint64_t plays; // sounds ever added, for sound age
+		int steal; // EnumSteal, how to pick a voice when pool is full
+		std::vector<float> buffer; // linear amplitude
 		//size_t samples;
-		float volume;
+		SDL_AudioSpec spec; // same as audio device, set by audio::mix_channel
+		float volume; // linear volume [0, 1], see ng::volume_to_amp
+		int resample; // EnumResample, for clips with a different rate
+		std::vector<Effect*> effects; // run in order after sounds are mixed
+		uint64_t frame; // audio timeline frame of buffer start, set by audio::mix_channel
+		size_t mixed; // sounds in the last mix, counted before ended ones are removed
 		
 		Channel ();
 		~Channel ();
 		
+		// Add effect to the end of the chain. Not thread-safe with mixing;
+		// in callback mode, call before add_channel.
+		void add_effect (Effect*);
+		
+		// Allocate a pool of max voices, and remove all queued sounds.
+		// Starts with 32 voices.
+		void set_voices (size_t max);
+		
 		// Queue a sound with EnumSound mode.
-		void play_sound (Clip*, int mode);
+		// Never allocates. If every voice is busy, steals one with the same or
+		// lower priority. Returns false if there is none, and sound is dropped.
+		bool play_sound (Clip*, int mode);
+		bool play_sound (Clip*, int mode, int priority, float volume);
+		
+		// Queue a stream with EnumSound mode. Stream plays from where it is.
+		// A stream plays on one voice at a time; returns false if it already is.
+		bool play_sound (Stream*, int mode);
+		
+		// Queue a sound or stream to start exactly on audio timeline frame, see
+		// audio::now. If frame has passed, starts at the start of the next buffer.
+		bool play_sound_at (Clip*, int mode, uint64_t frame);
+		bool play_sound_at (Clip*, int mode, int priority, float volume, uint64_t frame);
+		bool play_sound_at (Stream*, int mode, uint64_t frame);
+		
+		// Internal. Called by play_sound.
+		// Copy sound into a free or stolen voice.
+		bool add_sound (const Sound& sound);
+		
+		// Internal. Called by play_sound.
+		// Take stream for one voice. Returns false if another voice has it.
+		bool use_stream (Stream*);
+		
+		// Internal. Called wherever a voice is dropped.
+		// Let go of the stream played by voice, if any, so it can play again.
+		void end_stream (size_t sound);
 		
 		// Internal. Called by mix.
-		// Remove queued sound.
+		// Remove queued sound, by moving the last sound into its voice.
 		void remove_sound (size_t sound);
 		
 		// Remove all queued sounds.
@@ -65,40 +360,289 @@ namespace ng {
 		// Allocate samples for buffer and fill with silence.
 		void clear (size_t samples);
 		
+		// Internal. Called by mix_sound and mix_stream.
+		// Frame in channel buffer the sound starts on, or frames if it starts later.
+		size_t start_frame (size_t sound, size_t frames);
+		
 		// Internal. Called by mix.
 		// Mix samples from sound clip into channel buffer.
 		int mix_sound (size_t sound);
 		
+		// Internal. Called by mix_sound.
+		// Mix samples from sound stream into channel buffer.
+		int mix_stream (size_t sound);
+		
 		// Internal. Called by audio::mix_channel.
-		// Mix sounds into channel buffer.
+		// Mix sounds into channel buffer, then run effects.
 		void mix ();
 	};
 	
+	// Message from game thread to audio thread, with EnumCommand mode.
+	class Command {
+	public:
+		int mode;
+		Channel* channel;
+		Bus* bus;
+		Clip* clip;
+		Stream* stream;
+		int sound; // EnumSound mode
+		int priority;
+		float volume;
+		uint64_t frame; // audio timeline frame to start on, 0 for next buffer
+		Effect* effect;
+		int effect_mode; // EnumEffect
+		float settings[4]; // from Effect::get_settings
+		
+		Command ();
+		~Command ();
+	};
+	
+	// Lock-free ring of commands, with a single producer and single consumer.
+	// Push never blocks or allocates, so it is safe to call every frame.
+	class CommandQueue {
+	public:
+		std::vector<Command> buffer;
+		SDL_atomic_t head; // next slot to push, written by producer only
+		SDL_atomic_t tail; // next slot to pop, written by consumer only
+		
+		CommandQueue ();
+		~CommandQueue ();
+		
+		// Allocate room for capacity commands and empty the queue.
+		// Not thread-safe. Call before the consumer starts.
+		void reset (size_t capacity);
+		
+		// Producer. Returns false if queue is full.
+		bool push (const Command& command);
+		
+		// Consumer. Returns false if queue is empty.
+		bool pop (Command* const command);
+	};
+	
+	// Worker threads that mix channels at the same time, each into its own
+	// channel buffer. The calling thread works too, and mix returns when all
+	// channels are mixed. Adding channel buffers together is left to the caller,
+	// in a fixed order, so output does not depend on which thread mixed what.
+	class MixPool {
+	public:
+		std::vector<SDL_Thread*> threads;
+		SDL_sem* start; // posted once per worker per batch
+		SDL_sem* done; // posted once per worker per batch
+		SDL_atomic_t running;
+		SDL_atomic_t next; // index of next channel to mix
+		Channel* const* jobs; // batch, valid during mix
+		size_t count;
+		SDL_AudioSpec spec;
+		size_t samples;
+		uint64_t frame;
+		
+		MixPool ();
+		~MixPool ();
+		
+		// Start worker threads. Closes any running workers first.
+		void open (int workers);
+		
+		// Stop and join worker threads.
+		void close ();
+		
+		// Clear and mix count channels, each with spec and samples, for the
+		// buffer starting on audio timeline frame. Blocks.
+		// Each channel must appear once.
+		void mix (Channel* const* channels, size_t count, const SDL_AudioSpec& spec,
+			size_t samples, uint64_t frame);
+		
+		// Internal. Mix channels until none are left.
+		void work ();
+	};
+	
+	// Audio performance counters, cheap enough to leave on and read every frame.
+	// Queue depth is measured by clear, and mix time from clear to play.
+	// In callback mode, queue depth is the device chunk, and mix time is per callback.
+	class AudioStats {
+	public:
+		double queued_ms; // audio waiting in device queue, at last clear
+		double latency_ms; // audio waiting in device queue, after last play
+		double min_queued_ms; // since playing, or reset
+		double max_queued_ms;
+		double mix_ms; // time to mix and queue last buffer
+		int voices; // sounds playing in last buffer
+		int64_t buffers; // buffers mixed
+		// Callback mode counts a buffer that took longer to mix than it plays.
+		int64_t underruns; // times the device queue ran dry
+		int64_t dropped; // samples of silence the device played, estimated
+		
+		AudioStats ();
+		~AudioStats ();
+		
+		void reset ();
+	};
+	
 	class Audio {
 	public:
 		SDL_AudioDeviceID device;
 		SDL_AudioSpec spec;
-		std::vector<float> buffer;
+		int mode; // EnumAudioMode
+		std::vector<float> buffer; // linear amplitude
 		//size_t samples;
-		float volume;
+		float volume; // linear volume [0, 1], see ng::volume_to_amp
 		bool playing;
+		uint64_t frame; // audio timeline frame of the next buffer to mix
+		
+		// Counters. In callback mode, read with get_stats.
+		AudioStats stats;
+		uint64_t mix_start; // performance counter at clear
+		uint64_t play_end; // performance counter at end of last play
+		int64_t play_queued; // samples in device queue at end of last play
+		
+		// Queue mode. Clear mixes enough to keep the device queue near target_ms,
+		// correcting fully once it is more than tolerance_ms away.
+		int target_ms;
+		int tolerance_ms;
+		double frame_ms; // time between clears, rises fast and falls slowly
+		
+		// Offline mode. Every buffer played, after volume.
+		std::vector<float> output; // linear amplitude
+		uint64_t clear_rem; // thousandths of a frame left over by clear(ms)
+		
+		// Buses in topological order, parents before children.
+		std::vector<Bus*> buses;
+		
+		// Callback mode. Channels mixed by the audio thread, and commands to it.
+		std::vector<Channel*> channels;
+		CommandQueue commands;
+		
+		// With workers, mix_channel only adds to pending, and play mixes them all
+		// at once before adding them up in mix_channel order. Queue and offline
+		// mode only, on the game thread; callback mode mixes channels instead.
+		MixPool pool;
+		std::vector<Channel*> pending;
 		
 		Audio ();
 		~Audio ();
 		
-		// Open audio device in a paused state.
+		// Open audio device in a paused state, in queue mode.
 		void open ();
 		
-		// Close audio device.
+		// Open audio device in a paused state, with EnumAudioMode mode.
+		// In callback mode, clear, mix_channel, and play only unpause the device,
+		// so game code runs unchanged while the audio thread does the mixing.
+		// In offline mode, there is no device, and play appends to output.
+		void open (int mode);
+		
+		// Mix channels on worker threads, plus the calling thread. 0 mixes one
+		// channel at a time in mix_channel (default). Output is the same either way.
+		// In callback mode, call before the first play.
+		void set_workers (int workers);
+		
+		// Queue mode. Set device queue depth to keep, in ms, and how far it may
+		// drift before clear corrects all of it at once. 40 and 10 by default.
+		void set_latency (int target_ms, int tolerance_ms);
+		
+		// Copy of stats, safe to call from game thread in any mode.
+		AudioStats get_stats ();
+		
+		// Offline mode. Write output to a .wav file, as float32 at spec rate.
+		// Throws logic_error if output is too big for a .wav file (4GB).
+		void save (const char* file);
+		
+		// Callback mode. Give channel to the audio thread, to be mixed every callback.
+		// Call before the first play. Afterwards, change the channel only through
+		// play_sound, stop, set_volume, and set_effect. Prepares its effects.
+		// Throws logic_error if the channel's bus was not added with add_bus.
+		void add_channel (Channel*);
+		
+		// Add bus, mixed into parent bus, or into buffer if parent is NULL.
+		// Parent must be added first. In callback mode, call before the first play.
+		void add_bus (Bus* bus, Bus* parent);
+		
+		// Queue a sound with EnumSound mode on channel.
+		// Acts now in queue mode, or sends a command in callback mode.
+		// A stream plays on one voice at a time, so queueing one that is already
+		// playing, here or with play_sound_at, throws logic_error.
+		void play_sound (Channel*, Clip*, int mode);
+		void play_sound (Channel*, Clip*, int mode, int priority, float volume);
+		void play_sound (Channel*, Stream*, int mode);
+		
+		// Queue a sound or stream on channel, to start exactly on audio timeline
+		// frame. Schedule at least latency ahead of now to be on time.
+		void play_sound_at (Channel*, Clip*, int mode, uint64_t frame);
+		void play_sound_at (Channel*, Clip*, int mode, int priority, float volume,
+			uint64_t frame);
+		void play_sound_at (Channel*, Stream*, int mode, uint64_t frame);
+		
+		// Audio timeline frame being heard now: frames played, minus frames still
+		// queued. Frames are at spec.freq, from 0 when audio opens.
+		uint64_t now ();
+		
+		// Remove all queued sounds on channel.
+		void stop (Channel*);
+		
+		// Set channel volume, bus volume, or audio volume.
+		void set_volume (Channel*, float volume);
+		void set_volume (Bus*, float volume);
+		void set_volume (float volume);
+		
+		// Change a mixed effect to the mode and settings of another effect, set
+		// with a set_ method. Never allocates, so a delay may not grow longer than
+		// when the effect was prepared; throws logic_error if it does.
+		void set_effect (Effect* effect, const Effect& settings);
+		
+		// Internal. Called by play_sound, stop, set_volume, and set_effect.
+		// Act now in queue mode, or push command in callback mode.
+		void send (const Command& command);
+		
+		// Internal. Called by the audio thread.
+		// Act on a command.
+		void run (const Command& command);
+		
+		// Internal. Called by the audio thread in callback mode.
+		// Run commands, then mix channels into stream.
+		void mix_stream (uint8_t* stream, int bytes);
+		
+		// Close audio device, if any, and worker threads. Resets the timeline.
 		void close ();
 		
-		// Allocate at least ms of samples for buffer and fill with silence.
+		// Allocate samples for buffer and fill with silence.
+		// In queue mode, allocates enough to keep the device queue near target_ms
+		// until the next clear. Ms is the expected time until then, used until
+		// clears have been timed.
+		// In offline mode, allocates exactly ms of samples.
 		void clear (int ms);
 		
 		// Clear channel, mix sounds, and mix channel buffer.
+		// With workers, waits for play, and each channel may be mixed once per buffer.
+		// Throws logic_error if the channel's bus was not added with add_bus.
 		void mix_channel (Channel*);
 		
-		// Send buffer to audio device and set playing to true.
+		// Internal. Called by clear.
+		// Update queue depth and underrun counters, given samples in device queue.
+		void count_queue (int queue_samples);
+		
+		// Internal. Called by mix_channel and mix_stream.
+		// Clear channel, mix sounds, and mix channel buffer into its bus.
+		void mix_channel_buffer (Channel*);
+		
+		// Internal. Called by mix_channel_buffer, mix_pending, and mix_stream.
+		// Mix channel buffer, already mixed, into its bus.
+		void add_channel_buffer (Channel*);
+		
+		// Internal. Called by add_bus, add_channel, and mix_channel.
+		// True if bus is NULL or was added with add_bus.
+		bool has_bus (const Bus* bus) const;
+		
+		// Internal. Called by play.
+		// Mix pending channels on the pool, then add them up in order.
+		void mix_pending ();
+		
+		// Internal. Called by clear and mix_stream.
+		// Fill bus buffers with silence, the same size as buffer.
+		void clear_buses ();
+		
+		// Internal. Called by play and mix_stream.
+		// Mix each bus into its parent, children first, in one pass.
+		void mix_buses ();
+		
+		// Mix buses, apply volume to buffer, send buffer to audio device, and set playing to true.
 		void play ();
 	};
 
@@ -71,6 +71,11 @@ class Space2;
 // nggraphics
 class Color;
 class Image;
+class Atlas;
+class SpriteBatch;
+class ShapeBatch;
+class RenderCommand;
+class RenderTarget;
 class Graphics;
 
 // nggui
@@ -78,14 +83,26 @@ class Graphics;
 class Tileset;
 class Button;
 class Label;
+class TextRun;
 class Canvas;
 
 // ngaudio
 class Clip;
+class Stream;
 class Sound;
+class Bus;
+class Effect;
 class Channel;
+class Command;
+class CommandQueue;
+class MixPool;
+class AudioStats;
 class Audio;
 
+// ngload
+class Asset;
+class Loader;
+
 // ngevent
 class Mouse;
 class Key;
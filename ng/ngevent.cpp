@@ -215,6 +215,12 @@ bool ng::Event::next () {
 				this->mode = ng::WindowEvent;
 				this->window_event(&this->event);
 				return true;
+			} case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET: {
+				// Handled here, so the window redraws without the game asking.
+				this->graphics->reset_targets();
+				this->mode = ng::None;
+				break;
 			} default: {
 				this->mode = ng::None;
 			}
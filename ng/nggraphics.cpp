@@ -3,6 +3,8 @@
 
 #include "nggraphics.h"
 //#include "ngmath.h"
+#include <algorithm>
+#include <functional>
 
 // Switch between window and graphics coordinates.
 // Window (0,0) is top-left corner, +x points right, and +y points down.
@@ -133,11 +135,19 @@ ng::Image::Image () :
 	w(0.0),
 	h(0.0),
 	color(255, 255, 255),
-	flip(ng::None)
+	flip(ng::None),
+	atlas(NULL),
+	x(0),
+	y(0),
+	texture_w(0.0),
+	texture_h(0.0)
 {}
 
 ng::Image::~Image () {
-	if (this->texture != NULL) {
+	// Atlas textures belong to the atlas.
+	if (this->atlas != NULL) {
+		this->atlas->remove(this);
+	} else if (this->texture != NULL) {
 		SDL_DestroyTexture(this->texture);
 		this->texture = NULL;
 	}
@@ -162,19 +172,43 @@ void ng::Image::load (Graphics* const graphics, const char* file, const Color& k
 		throw std::runtime_error(SDL_GetError());
 	}
 	
+	if (this->atlas != NULL) {
+		this->atlas->remove(this);
+	}
 	this->texture = texture;
 	this->w = static_cast<double>(surface->w);
 	this->h = static_cast<double>(surface->h);
+	this->atlas = NULL;
+	this->x = 0;
+	this->y = 0;
+	this->texture_w = this->w;
+	this->texture_h = this->h;
 }
 
-void ng::Image::set_color (const Color& color) {
-	if (this->color.r == color.r && this->color.g == color.g && this->color.b == color.b) {
-		return;
-	}
-	// This is a different color.
-	if (SDL_SetTextureColorMod(this->texture, color.r, color.g, color.b) != 0) {
+// Make texture from a decoded surface, with its color key.
+void ng::Image::load (Graphics* const graphics, SDL_Surface* surface) {
+	SDL_Texture* texture = NULL;
+	texture = SDL_CreateTextureFromSurface(graphics->renderer, surface);
+	if (texture == NULL) {
 		throw std::runtime_error(SDL_GetError());
 	}
+	
+	if (this->atlas != NULL) {
+		this->atlas->remove(this);
+	}
+	this->texture = texture;
+	this->w = static_cast<double>(surface->w);
+	this->h = static_cast<double>(surface->h);
+	this->atlas = NULL;
+	this->x = 0;
+	this->y = 0;
+	this->texture_w = this->w;
+	this->texture_h = this->h;
+}
+
+// Color is given to each vertex when drawn, not to the texture, so one batch
+// can draw the same image in many colors.
+void ng::Image::set_color (const Color& color) {
 	this->color.r = color.r;
 	this->color.g = color.g;
 	this->color.b = color.b;
@@ -184,8 +218,9 @@ void ng::Image::set_alpha (const Color& color) {
 	if (this->color.a == color.a) {
 		return;
 	}
-	// This is a different alpha.
-	if (SDL_SetTextureAlphaMod(this->texture, color.a) != 0) {
+	// This is a different alpha. Vertex alpha needs blending.
+	if (color.a != 255 &&
+	SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND) != 0) {
 		throw std::runtime_error(SDL_GetError());
 	}
 	this->color.a = color.a;
@@ -197,17 +232,481 @@ void ng::Image::set_flip (int flip) {
 }
 */
 
+ng::Atlas::Atlas () :
+	page_w(1024),
+	page_h(1024),
+	built(false)
+{}
+
+ng::Atlas::~Atlas () {
+	this->reset(this->page_w, this->page_h);
+}
+
+// Free every page, and start over with pages of w*h pixels.
+void ng::Atlas::reset (int page_w, int page_h) {
+	if (page_w <= 0 || page_h <= 0) {
+		throw std::logic_error("atlas page size must be > 0");
+	}
+	// Built images point into pages. Images added but not built do not.
+	for (size_t i=0; i < this->images.size(); i++) {
+		if (this->images[i]->atlas == this) {
+			this->images[i]->texture = NULL;
+			this->images[i]->atlas = NULL;
+		}
+	}
+	for (size_t i=0; i < this->textures.size(); i++) {
+		SDL_DestroyTexture(this->textures[i]);
+	}
+	for (size_t i=0; i < this->surfaces.size(); i++) {
+		SDL_FreeSurface(this->surfaces[i]);
+	}
+	this->textures.clear();
+	this->images.clear();
+	this->surfaces.clear();
+	this->page_w = page_w;
+	this->page_h = page_h;
+	this->built = false;
+}
+
+// Load a BMP file with color key, to be packed into image by build.
+void ng::Atlas::add (Image* image, const char* file, const Color& key) {
+	SDL_Surface* surface = NULL;
+	surface = SDL_LoadBMP(file);
+	if (surface == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	if (SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format,
+	key.r, key.g, key.b)) != 0) {
+		SDL_FreeSurface(surface);
+		throw std::runtime_error(SDL_GetError());
+	}
+	this->add(image, surface);
+}
+
+// Take a decoded surface, with its color key, to be packed into image by build.
+void ng::Atlas::add (Image* image, SDL_Surface* surface) {
+	if (this->built) {
+		SDL_FreeSurface(surface);
+		throw std::logic_error("atlas is already built, reset it first");
+	}
+	if (surface->w + 2 > this->page_w || surface->h + 2 > this->page_h) {
+		SDL_FreeSurface(surface);
+		throw std::logic_error("image is larger than atlas page");
+	}
+	this->images.push_back(image);
+	this->surfaces.push_back(surface);
+}
+
+// Lowest y an w wide area can start at, from skyline segment i, or -1 if
+// it runs off the page. Segments are x, y (height), and w.
+static int skyline_fit (const std::vector<SDL_Rect>& skyline, size_t i, int w,
+int page_w) {
+	int x = skyline[i].x;
+	if (x + w > page_w) {
+		return -1;
+	}
+	int y = 0;
+	int left = w;
+	for (size_t j=i; left > 0 && j < skyline.size(); j++) {
+		if (skyline[j].y > y) {
+			y = skyline[j].y;
+		}
+		left -= skyline[j].w;
+	}
+	return y;
+}
+
+// Raise skyline to y+h over [x, x+w).
+static void skyline_place (std::vector<SDL_Rect>* skyline, size_t i, int x, int y,
+int w, int h) {
+	SDL_Rect top;
+	top.x = x;
+	top.y = y + h;
+	top.w = w;
+	top.h = 0;
+	skyline->insert(skyline->begin() + i, top);
+	
+	// Cut segments now under top.
+	size_t j = i + 1;
+	while (j < skyline->size()) {
+		SDL_Rect& s = (*skyline)[j];
+		int covered = x + w - s.x;
+		if (covered <= 0) {
+			break;
+		}
+		if (covered < s.w) {
+			s.x += covered;
+			s.w -= covered;
+			break;
+		}
+		skyline->erase(skyline->begin() + j);
+	}
+	
+	// Merge neighbours at the same height.
+	for (size_t k=0; k+1 < skyline->size();) {
+		if ((*skyline)[k].y == (*skyline)[k+1].y) {
+			(*skyline)[k].w += (*skyline)[k+1].w;
+			skyline->erase(skyline->begin() + k + 1);
+		} else {
+			k++;
+		}
+	}
+}
+
+// Build order: image index a before b if its surface is taller.
+struct AtlasTaller {
+	const std::vector<SDL_Surface*>* surfaces;
+	
+	bool operator() (size_t a, size_t b) const {
+		return (*this->surfaces)[a]->h > (*this->surfaces)[b]->h;
+	}
+};
+
+// Pack added images into pages, make a texture per page, and point each image
+// at its area.
+void ng::Atlas::build (Graphics* const graphics) {
+	if (this->built) {
+		throw std::logic_error("atlas is already built, reset it first");
+	}
+	
+	// Tallest first packs tighter. Ties keep the order images were added.
+	std::vector<size_t> order(this->images.size());
+	for (size_t i=0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	AtlasTaller taller;
+	taller.surfaces = &this->surfaces;
+	std::stable_sort(order.begin(), order.end(), taller);
+	
+	// Place each image, padded by 1 pixel on every side, at the lowest spot of
+	// any page, or on a new page.
+	std::vector<std::vector<SDL_Rect> > skylines;
+	std::vector<SDL_Rect> places(this->images.size());
+	std::vector<size_t> pages(this->images.size());
+	for (size_t n=0; n < order.size(); n++) {
+		size_t a = order[n];
+		int w = this->surfaces[a]->w + 2;
+		int h = this->surfaces[a]->h + 2;
+		bool found = false;
+		size_t best_page = 0;
+		size_t best_i = 0;
+		int best_y = 0;
+		for (size_t p=0; p < skylines.size(); p++) {
+			for (size_t i=0; i < skylines[p].size(); i++) {
+				int y = skyline_fit(skylines[p], i, w, this->page_w);
+				if (y < 0 || y + h > this->page_h) {
+					continue;
+				}
+				if (!found || y < best_y) {
+					found = true;
+					best_page = p;
+					best_i = i;
+					best_y = y;
+				}
+			}
+		}
+		if (!found) {
+			SDL_Rect ground;
+			ground.x = 0;
+			ground.y = 0;
+			ground.w = this->page_w;
+			ground.h = 0;
+			skylines.push_back(std::vector<SDL_Rect>(1, ground));
+			best_page = skylines.size() - 1;
+			best_i = 0;
+			best_y = 0;
+		}
+		int x = skylines[best_page][best_i].x;
+		skyline_place(&skylines[best_page], best_i, x, best_y, w, h);
+		places[a].x = x + 1;
+		places[a].y = best_y + 1;
+		places[a].w = w - 2;
+		places[a].h = h - 2;
+		pages[a] = best_page;
+	}
+	
+	// Copy images into transparent pages. Copying, not blending, keeps
+	// colors as they are, and color-keyed pixels are skipped, so they stay clear.
+	std::vector<SDL_Surface*> page_surfaces;
+	try {
+		for (size_t p=0; p < skylines.size(); p++) {
+			SDL_Surface* page = SDL_CreateRGBSurfaceWithFormat(0, this->page_w,
+				this->page_h, 32, SDL_PIXELFORMAT_RGBA32);
+			if (page == NULL) {
+				throw std::runtime_error(SDL_GetError());
+			}
+			page_surfaces.push_back(page);
+			SDL_FillRect(page, NULL, SDL_MapRGBA(page->format, 0, 0, 0, 0));
+		}
+		for (size_t a=0; a < this->images.size(); a++) {
+			SDL_SetSurfaceBlendMode(this->surfaces[a], SDL_BLENDMODE_NONE);
+			if (SDL_BlitSurface(this->surfaces[a], NULL, page_surfaces[pages[a]],
+			&places[a]) != 0) {
+				throw std::runtime_error(SDL_GetError());
+			}
+		}
+		for (size_t p=0; p < page_surfaces.size(); p++) {
+			SDL_Texture* texture = SDL_CreateTextureFromSurface(graphics->renderer,
+				page_surfaces[p]);
+			if (texture == NULL) {
+				throw std::runtime_error(SDL_GetError());
+			}
+			this->textures.push_back(texture);
+			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+		}
+	} catch (...) {
+		for (size_t p=0; p < page_surfaces.size(); p++) {
+			SDL_FreeSurface(page_surfaces[p]);
+		}
+		throw;
+	}
+	for (size_t p=0; p < page_surfaces.size(); p++) {
+		SDL_FreeSurface(page_surfaces[p]);
+	}
+	
+	for (size_t a=0; a < this->images.size(); a++) {
+		Image* image = this->images[a];
+		if (image->texture != NULL && image->atlas == NULL) {
+			SDL_DestroyTexture(image->texture);
+		}
+		image->texture = this->textures[pages[a]];
+		image->atlas = this;
+		image->x = places[a].x;
+		image->y = places[a].y;
+		image->w = static_cast<double>(places[a].w);
+		image->h = static_cast<double>(places[a].h);
+		image->texture_w = static_cast<double>(this->page_w);
+		image->texture_h = static_cast<double>(this->page_h);
+		SDL_FreeSurface(this->surfaces[a]);
+	}
+	this->surfaces.clear();
+	this->built = true;
+}
+
+// Forget a built image, so reset does not touch it.
+void ng::Atlas::remove (Image* image) {
+	for (size_t i=0; i < this->images.size(); i++) {
+		if (this->images[i] == image) {
+			this->images.erase(this->images.begin() + i);
+			return;
+		}
+	}
+}
+
+ng::SpriteBatch::SpriteBatch () :
+	texture(NULL)
+{}
+
+ng::SpriteBatch::~SpriteBatch () {}
+
+// Add quad with corners top-left, top-right, bottom-right, bottom-left.
+void ng::SpriteBatch::add (const SDL_Vertex* quad) {
+	int i = static_cast<int>(this->vertices.size());
+	this->vertices.insert(this->vertices.end(), quad, quad + 4);
+	// Two triangles: top-left, top-right, bottom-right, and bottom-right,
+	// bottom-left, top-left.
+	int index[6] = {i, i+1, i+2, i+2, i+3, i};
+	this->indices.insert(this->indices.end(), index, index + 6);
+}
+
+// Draw quads, and empty batch. Returns false if there was nothing to draw.
+bool ng::SpriteBatch::flush (SDL_Renderer* renderer) {
+	if (this->vertices.empty()) {
+		this->texture = NULL;
+		return false;
+	}
+	int result = SDL_RenderGeometry(renderer, this->texture,
+		this->vertices.data(), static_cast<int>(this->vertices.size()),
+		this->indices.data(), static_cast<int>(this->indices.size()));
+	// Keeps capacity, so a steady frame does not allocate.
+	this->vertices.clear();
+	this->indices.clear();
+	this->texture = NULL;
+	if (result != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	return true;
+}
+
+ng::ShapeBatch::ShapeBatch () :
+	mode(0),
+	draw(0)
+{}
+
+ng::ShapeBatch::~ShapeBatch () {}
+
+// Add point.
+void ng::ShapeBatch::add_point (const SDL_Point& p) {
+	this->mode = ng::RenderPoint;
+	this->points.push_back(p);
+}
+
+// Add line. A line starting where the last one ended joins its strip.
+void ng::ShapeBatch::add_line (const SDL_Point& p1, const SDL_Point& p2) {
+	this->mode = ng::RenderLine;
+	if (!this->strips.empty()) {
+		const SDL_Point& last = this->points.back();
+		if (last.x == p1.x && last.y == p1.y) {
+			this->points.push_back(p2);
+			this->strips.back()++;
+			return;
+		}
+	}
+	this->points.push_back(p1);
+	this->points.push_back(p2);
+	this->strips.push_back(static_cast<int>(this->points.size()));
+}
+
+// Add box.
+void ng::ShapeBatch::add_rect (const SDL_Rect& rect) {
+	this->mode = ng::RenderBox;
+	this->rects.push_back(rect);
+}
+
+// Draw shapes, one render call per strip or one for all points or boxes,
+// and empty batch. Returns the number of render calls.
+int ng::ShapeBatch::flush (SDL_Renderer* renderer) {
+	int calls = 0;
+	int result = 0;
+	switch (this->mode) {
+		case ng::RenderPoint: {
+			result = SDL_RenderDrawPoints(renderer, this->points.data(),
+				static_cast<int>(this->points.size()));
+			calls = 1;
+			break;
+		} case ng::RenderLine: {
+			int start = 0;
+			for (size_t i=0; i < this->strips.size() && result == 0; i++) {
+				int end = this->strips[i];
+				result = SDL_RenderDrawLines(renderer, this->points.data() + start,
+					end - start);
+				start = end;
+				calls++;
+			}
+			break;
+		} case ng::RenderBox: {
+			if (this->draw == ng::DrawFill) {
+				result = SDL_RenderFillRects(renderer, this->rects.data(),
+					static_cast<int>(this->rects.size()));
+			} else {
+				result = SDL_RenderDrawRects(renderer, this->rects.data(),
+					static_cast<int>(this->rects.size()));
+			}
+			calls = 1;
+			break;
+		} default: {
+			// Empty.
+		}
+	}
+	// Keeps capacity, so a steady frame does not allocate.
+	this->points.clear();
+	this->strips.clear();
+	this->rects.clear();
+	this->mode = 0;
+	if (result != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	return calls;
+}
+
+// Window pixel of graphics point.
+static SDL_Point window_point (const ng::Vec2& p, double rx, double ry) {
+	SDL_Point a;
+	a.x = static_cast<int>(ng::window_x(p.x, rx));
+	a.y = static_cast<int>(ng::window_y(p.y, ry));
+	return a;
+}
+
+ng::RenderCommand::RenderCommand () :
+	mode(0),
+	layer(0),
+	order(0),
+	texture(NULL),
+	blend(SDL_BLENDMODE_NONE),
+	color(),
+	draw(0),
+	quad()
+{}
+
+ng::RenderCommand::~RenderCommand () {}
+
+// Replay order: layer, then texture, then blend, then recorded order.
+static bool render_before (const ng::RenderCommand& a, const ng::RenderCommand& b) {
+	if (a.layer != b.layer) {
+		return a.layer < b.layer;
+	}
+	if (a.texture != b.texture) {
+		return std::less<SDL_Texture*>()(a.texture, b.texture);
+	}
+	if (a.blend != b.blend) {
+		return a.blend < b.blend;
+	}
+	return a.order < b.order;
+}
+
+ng::RenderTarget::RenderTarget () :
+	texture(NULL),
+	rx(0.0),
+	ry(0.0),
+	deferred(false),
+	clipped(false),
+	clip()
+{}
+
+ng::RenderTarget::~RenderTarget () {}
+
 ng::Graphics::Graphics () :
+	mode(ng::GraphicsWindow),
 	window(NULL),
 	renderer(NULL),
+	surface(NULL),
 	rx(0.0),
 	ry(0.0),
-	color(0, 0, 0)
+	color(0, 0, 0),
+	draws(0),
+	frame_draws(0),
+	deferred(false),
+	layer(0),
+	retained(false),
+	target(NULL),
+	target_w(0),
+	target_h(0),
+	damaged(false),
+	damage_rect(),
+	resets(0)
 {}
 
+// Open window and renderer, in window mode.
 void ng::Graphics::open (const char* title, double rx, double ry) {
+	this->open(title, rx, ry, ng::GraphicsWindow);
+}
+
+// Open with EnumGraphicsMode mode. Headless mode has no window, and draws
+// with the software renderer into surface.
+void ng::Graphics::open (const char* title, double rx, double ry, int mode) {
+	if (mode != ng::GraphicsWindow && mode != ng::GraphicsHeadless) {
+		throw std::logic_error("graphics mode must be window or headless");
+	}
+	this->mode = mode;
 	this->rx = rx;
 	this->ry = ry;
+	if (mode == ng::GraphicsHeadless) {
+		// Title is unused, with no window.
+		this->surface = SDL_CreateRGBSurfaceWithFormat(0,
+			static_cast<int>(rx*2.0), static_cast<int>(ry*2.0), 32,
+			SDL_PIXELFORMAT_RGBA8888);
+		if (this->surface == NULL) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		this->renderer = SDL_CreateSoftwareRenderer(this->surface);
+		if (this->renderer == NULL) {
+			std::runtime_error error(SDL_GetError());
+			SDL_FreeSurface(this->surface);
+			this->surface = NULL;
+			throw error;
+		}
+		return;
+	}
 	this->window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
 		static_cast<int>(rx*2.0), static_cast<int>(ry*2.0), SDL_WINDOW_RESIZABLE);
 	if (this->window == NULL) {
@@ -220,6 +719,10 @@ void ng::Graphics::open (const char* title, double rx, double ry) {
 }
 
 void ng::Graphics::close () {
+	if (this->target != NULL) {
+		SDL_DestroyTexture(this->target);
+		this->target = NULL;
+	}
 	if (this->renderer != NULL) {
 		SDL_DestroyRenderer(this->renderer);
 		this->renderer = NULL;
@@ -228,14 +731,35 @@ void ng::Graphics::close () {
 		SDL_DestroyWindow(this->window);
 		this->window = NULL;
 	}
+	// After the renderer that draws to it.
+	if (this->surface != NULL) {
+		SDL_FreeSurface(this->surface);
+		this->surface = NULL;
+	}
+}
+
+// Headless mode. Write surface, as drawn by the last draw, to a .bmp file.
+// Draw presents, and the software renderer has finished by then, so surface
+// holds exactly the last frame, for golden image tests.
+void ng::Graphics::save (const char* file) {
+	if (this->surface == NULL) {
+		throw std::logic_error("save needs headless graphics");
+	}
+	if (SDL_SaveBMP(this->surface, file) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
 }
 
 void ng::Graphics::set_color (const Color& color) {
 	if (this->color.r == color.r && this->color.g == color.g && this->color.b == color.b) {
 		return;
 	}
-	// This is a different color.
-	if (SDL_SetRenderDrawColor(this->renderer,
+	// This is a different color. Deferred draws set it on replay.
+	// Batched shapes take the old color.
+	if (!this->deferred) {
+		this->draws += this->shapes.flush(this->renderer);
+	}
+	if (!this->deferred && SDL_SetRenderDrawColor(this->renderer,
 	color.r, color.g, color.b, this->color.a) != 0) {
 		throw std::runtime_error(SDL_GetError());
 	}
@@ -248,7 +772,12 @@ void ng::Graphics::set_alpha (const Color& color) {
 	if (this->color.a == color.a) {
 		return;
 	}
-	// This is a different alpha.
+	// This is a different alpha. Deferred draws set it on replay.
+	if (this->deferred) {
+		this->color.a = color.a;
+		return;
+	}
+	this->draws += this->shapes.flush(this->renderer);
 	SDL_BlendMode blendmode;
 	if (color.a == 255) {
 		blendmode = SDL_BLENDMODE_NONE;
@@ -263,7 +792,11 @@ void ng::Graphics::set_alpha (const Color& color) {
 	this->color.a = color.a;
 }
 
+// Headless surface is a fixed size, so it cannot change.
 void ng::Graphics::set_window_dim (const Vec2& dim) {
+	if (this->mode == ng::GraphicsHeadless) {
+		throw std::logic_error("headless graphics can't change window size");
+	}
 	SDL_SetWindowSize(this->window,
 		static_cast<int>(dim.x*2.0),
 		static_cast<int>(dim.y*2.0));
@@ -279,7 +812,12 @@ void ng::Graphics::set_dim (const Vec2& dim) {
 Vec2 ng::Graphics::window_dim () const {
 	int w = 0;
 	int h = 0;
-	SDL_GetWindowSize(this->window, &w, &h);
+	if (this->surface != NULL) {
+		w = this->surface->w;
+		h = this->surface->h;
+	} else {
+		SDL_GetWindowSize(this->window, &w, &h);
+	}
 	Vec2 a(static_cast<double>(w)*0.5,
 	       static_cast<double>(h)*0.5);
 	return a;
@@ -291,14 +829,373 @@ Vec2 ng::Graphics::dim () const {
 	return a;
 }
 
+// In deferred mode, drops recorded draws, since clear would cover them.
+// In retained mode, clear only clears damage, and draws after it are
+// clipped to damage.
 void ng::Graphics::clear () {
+	this->flush();
+	if (this->deferred) {
+		this->commands.clear();
+		this->restore();
+	}
+	if (this->retained) {
+		this->begin_target();
+		SDL_Rect all;
+		all.x = 0;
+		all.y = 0;
+		all.w = this->target_w;
+		all.h = this->target_h;
+		if (!this->damaged ||
+		!SDL_IntersectRect(&this->damage_rect, &all, &this->damage_rect)) {
+			// Nothing to redraw. Stray draws go to the window, and draw covers them.
+			this->damaged = false;
+			return;
+		}
+		this->damaged = false;
+		// RenderClear ignores the clip rect, so fill damage with an opaque copy of
+		// the color instead.
+		if (SDL_SetRenderTarget(this->renderer, this->target) != 0 ||
+		SDL_RenderSetClipRect(this->renderer, &this->damage_rect) != 0 ||
+		SDL_SetRenderDrawBlendMode(this->renderer, SDL_BLENDMODE_NONE) != 0 ||
+		SDL_RenderFillRect(this->renderer, &this->damage_rect) != 0) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		this->draws++;
+		this->restore();
+		return;
+	}
 	if (SDL_RenderClear(this->renderer) != 0) {
 		throw std::runtime_error(SDL_GetError());
 	}
 }
 
 void ng::Graphics::draw () {
+	this->replay();
+	this->flush();
+	if (this->retained && this->target != NULL) {
+		// Show kept window, over anything drawn to the window itself.
+		if (SDL_RenderSetClipRect(this->renderer, NULL) != 0 ||
+		SDL_SetRenderTarget(this->renderer, NULL) != 0 ||
+		SDL_RenderCopy(this->renderer, this->target, NULL, NULL) != 0) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		this->draws++;
+	}
 	SDL_RenderPresent(this->renderer);
+	this->frame_draws = this->draws;
+	this->draws = 0;
+}
+
+// Draw batched images and shapes now.
+void ng::Graphics::flush () {
+	if (this->batch.flush(this->renderer)) {
+		this->draws++;
+	}
+	this->draws += this->shapes.flush(this->renderer);
+}
+
+// Flush batches that cannot take a shape of mode and draw.
+void ng::Graphics::begin_shapes (int mode, int draw) {
+	if (!this->batch.vertices.empty() || (this->shapes.mode != 0 &&
+	(this->shapes.mode != mode || this->shapes.draw != draw))) {
+		this->flush();
+	}
+	this->shapes.draw = draw;
+}
+
+// Record draws, and replay them sorted when drawn, instead of drawing now.
+// Off by default. Turning it off replays what was recorded.
+void ng::Graphics::set_deferred (bool deferred) {
+	if (this->deferred == deferred) {
+		return;
+	}
+	this->flush();
+	this->replay();
+	this->deferred = deferred;
+	// Color and alpha set while deferred were only stored, so give them to
+	// the renderer now, even if nothing was replayed.
+	if (!deferred && this->renderer != NULL) {
+		this->restore();
+	}
+}
+
+// Set layer of following draws, in deferred mode.
+void ng::Graphics::set_layer (int layer) {
+	this->layer = layer;
+}
+
+// Keep the window between frames, and redraw only damage.
+// Off by default. Turning it on damages the whole window.
+void ng::Graphics::set_retained (bool retained) {
+	if (this->retained == retained) {
+		return;
+	}
+	this->replay();
+	this->flush();
+	this->retained = retained;
+	if (retained) {
+		this->damage();
+		return;
+	}
+	if (this->target != NULL) {
+		if (SDL_RenderSetClipRect(this->renderer, NULL) != 0 ||
+		SDL_SetRenderTarget(this->renderer, NULL) != 0) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		SDL_DestroyTexture(this->target);
+		this->target = NULL;
+	}
+	this->damaged = false;
+}
+
+// Mark box to be redrawn by the next clear, in retained mode.
+void ng::Graphics::damage (const Box2& box) {
+	if (!this->retained) {
+		return;
+	}
+	// Damage is on the window, even while drawing to a texture.
+	double rx = this->rx;
+	double ry = this->ry;
+	if (!this->targets.empty()) {
+		rx = this->targets.front().rx;
+		ry = this->targets.front().ry;
+	}
+	SDL_Rect rect = ng::sdl_rect(ng::window_rect(box, rx, ry));
+	// Grow a pixel each way, for rounding and frame edges.
+	rect.x -= 1;
+	rect.y -= 1;
+	rect.w += 2;
+	rect.h += 2;
+	if (this->damaged) {
+		SDL_UnionRect(&this->damage_rect, &rect, &this->damage_rect);
+	} else {
+		this->damage_rect = rect;
+		this->damaged = true;
+	}
+}
+
+// Mark whole window to be redrawn.
+void ng::Graphics::damage () {
+	Box2 box(0.0, 0.0, this->rx, this->ry);
+	this->damage(box);
+}
+
+// True if the next clear will redraw anything.
+bool ng::Graphics::dirty () const {
+	if (!this->retained || this->damaged || this->target == NULL) {
+		return true;
+	}
+	int w = 0;
+	int h = 0;
+	if (SDL_GetRendererOutputSize(this->renderer, &w, &h) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	return w != this->target_w || h != this->target_h;
+}
+
+// Make target texture fit the window. A new texture is all damage.
+void ng::Graphics::begin_target () {
+	int w = 0;
+	int h = 0;
+	if (SDL_GetRendererOutputSize(this->renderer, &w, &h) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	if (this->target != NULL && w == this->target_w && h == this->target_h) {
+		return;
+	}
+	if (this->target != NULL) {
+		SDL_DestroyTexture(this->target);
+	}
+	this->target = SDL_CreateTexture(this->renderer, SDL_PIXELFORMAT_RGBA8888,
+		SDL_TEXTUREACCESS_TARGET, w, h);
+	if (this->target == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	// Copied to the window as is, not blended.
+	if (SDL_SetTextureBlendMode(this->target, SDL_BLENDMODE_NONE) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	this->target_w = w;
+	this->target_h = h;
+	this->damage_rect.x = 0;
+	this->damage_rect.y = 0;
+	this->damage_rect.w = w;
+	this->damage_rect.h = h;
+	this->damaged = true;
+}
+
+// Draw to texture as if it were box on the window, until end_texture.
+void ng::Graphics::begin_texture (SDL_Texture* texture, const Box2& box) {
+	this->flush();
+	RenderTarget saved;
+	saved.texture = SDL_GetRenderTarget(this->renderer);
+	saved.rx = this->rx;
+	saved.ry = this->ry;
+	saved.deferred = this->deferred;
+	saved.clipped = SDL_RenderIsClipEnabled(this->renderer) == SDL_TRUE;
+	SDL_RenderGetClipRect(this->renderer, &saved.clip);
+	this->targets.push_back(saved);
+	
+	if (SDL_SetRenderTarget(this->renderer, texture) != 0 ||
+	SDL_RenderSetClipRect(this->renderer, NULL) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	// Draws map to pixels by rx and ry, so this puts the top-left corner of
+	// box at the top-left pixel of texture.
+	this->rx = box.rx - box.x;
+	this->ry = box.ry + box.y;
+	// Draws go into texture now, not into the recorded frame.
+	this->deferred = false;
+	this->restore();
+}
+
+// Go back to drawing where begin_texture left off.
+void ng::Graphics::end_texture () {
+	if (this->targets.empty()) {
+		throw std::logic_error("end_texture needs begin_texture");
+	}
+	this->flush();
+	RenderTarget saved = this->targets.back();
+	this->targets.pop_back();
+	
+	// Switching targets drops the clip rect, so put it back.
+	const SDL_Rect* clip = NULL;
+	if (saved.clipped) {
+		clip = &saved.clip;
+	}
+	if (SDL_SetRenderTarget(this->renderer, saved.texture) != 0 ||
+	SDL_RenderSetClipRect(this->renderer, clip) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	this->rx = saved.rx;
+	this->ry = saved.ry;
+	this->deferred = saved.deferred;
+}
+
+// Rebuild the target texture, and count resets so canvas caches redraw.
+void ng::Graphics::reset_targets () {
+	this->resets++;
+	if (this->target == NULL) {
+		return;
+	}
+	// Draw leaves the window as render target, so target is not in use.
+	// Its contents are gone, and after a device reset so is the texture.
+	SDL_DestroyTexture(this->target);
+	this->target = NULL;
+	this->damage();
+}
+
+// Sort and replay recorded draws, then forget them.
+// Images go through the batch, so a run of one texture is one render call.
+// Shapes go through the shape batch, and set draw color and blend mode only
+// when they change.
+void ng::Graphics::replay () {
+	if (this->commands.empty()) {
+		return;
+	}
+	std::sort(this->commands.begin(), this->commands.end(), render_before);
+	
+	bool known = false; // renderer state unknown until first shape
+	SDL_Color color;
+	SDL_BlendMode blend = SDL_BLENDMODE_NONE;
+	for (size_t i=0; i < this->commands.size(); i++) {
+		const RenderCommand& command = this->commands[i];
+		if (command.mode == ng::RenderImage) {
+			if (this->batch.texture != command.texture) {
+				this->flush();
+				this->batch.texture = command.texture;
+			}
+			this->batch.add(command.quad);
+			continue;
+		}
+		
+		this->begin_shapes(command.mode, command.draw);
+		bool change = !known || blend != command.blend ||
+			color.r != command.color.r || color.g != command.color.g ||
+			color.b != command.color.b || color.a != command.color.a;
+		if (change) {
+			this->draws += this->shapes.flush(this->renderer);
+		}
+		if (!known || blend != command.blend) {
+			if (SDL_SetRenderDrawBlendMode(this->renderer, command.blend) != 0) {
+				throw std::runtime_error(SDL_GetError());
+			}
+			blend = command.blend;
+		}
+		if (!known || color.r != command.color.r || color.g != command.color.g ||
+		color.b != command.color.b || color.a != command.color.a) {
+			if (SDL_SetRenderDrawColor(this->renderer, command.color.r,
+			command.color.g, command.color.b, command.color.a) != 0) {
+				throw std::runtime_error(SDL_GetError());
+			}
+			color = command.color;
+		}
+		known = true;
+		
+		// Positions were whole pixels when recorded.
+		SDL_Point a;
+		a.x = static_cast<int>(command.quad[0].position.x);
+		a.y = static_cast<int>(command.quad[0].position.y);
+		switch (command.mode) {
+			case ng::RenderBox: {
+				SDL_Rect rect;
+				rect.x = a.x;
+				rect.y = a.y;
+				rect.w = static_cast<int>(command.quad[2].position.x) - a.x;
+				rect.h = static_cast<int>(command.quad[2].position.y) - a.y;
+				this->shapes.add_rect(rect);
+				break;
+			} case ng::RenderLine: {
+				SDL_Point b;
+				b.x = static_cast<int>(command.quad[1].position.x);
+				b.y = static_cast<int>(command.quad[1].position.y);
+				this->shapes.add_line(a, b);
+				break;
+			} case ng::RenderPoint: default: {
+				this->shapes.add_point(a);
+			}
+		}
+	}
+	this->flush();
+	// Keeps capacity, so a steady frame does not allocate.
+	this->commands.clear();
+	if (known) {
+		this->restore();
+	}
+}
+
+// Record draw with current layer. Shapes also take current color and blend.
+void ng::Graphics::record (const RenderCommand& command) {
+	this->commands.push_back(command);
+	RenderCommand& last = this->commands.back();
+	last.layer = this->layer;
+	last.order = static_cast<uint32_t>(this->commands.size() - 1);
+	if (last.mode != ng::RenderImage) {
+		last.color.r = static_cast<Uint8>(this->color.r);
+		last.color.g = static_cast<Uint8>(this->color.g);
+		last.color.b = static_cast<Uint8>(this->color.b);
+		last.color.a = static_cast<Uint8>(this->color.a);
+		if (this->color.a == 255) {
+			last.blend = SDL_BLENDMODE_NONE;
+		} else {
+			last.blend = SDL_BLENDMODE_BLEND;
+		}
+	}
+}
+
+// Set renderer draw color and blend mode to current color.
+void ng::Graphics::restore () {
+	SDL_BlendMode blendmode;
+	if (this->color.a == 255) {
+		blendmode = SDL_BLENDMODE_NONE;
+	} else {
+		blendmode = SDL_BLENDMODE_BLEND;
+	}
+	if (SDL_SetRenderDrawBlendMode(this->renderer, blendmode) != 0 ||
+	SDL_SetRenderDrawColor(this->renderer,
+	this->color.r, this->color.g, this->color.b, this->color.a) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
 }
 
 // Draw a message box.
@@ -339,41 +1236,109 @@ void ng::Graphics::draw_image (Image* const image, const Box2& dest) {
 
 // Draw part of image to part of window.
 void ng::Graphics::draw_image (Image* const image, const Rect2& src, const Box2& dest) {
-	SDL_Rect src_sdl = ng::sdl_rect(src);
-	SDL_Rect dest_sdl = ng::sdl_rect(ng::window_rect(dest));
-	
-	if (SDL_RenderCopy(this->renderer, image->texture, &src_sdl, &dest_sdl) != 0) {
-		throw std::runtime_error(SDL_GetError());
-	}
+	this->draw_image(image, src, dest, 0.0, ng::None);
 }
 
+// Quad goes into the batch. A different texture flushes the batch first.
+// Angle turns clockwise on screen, like SDL_RenderCopyEx.
 void ng::Graphics::draw_image (Image* const image, const Rect2& src, const Box2& dest,
 double angle, int flip) {
-	SDL_Rect src_sdl = ng::sdl_rect(src);
-	SDL_Rect dest_sdl = ng::sdl_rect(ng::window_rect(dest));
+	SDL_Vertex quad[4];
+	this->image_quad(image, src, dest, angle, flip, quad);
+	this->draw_quads(image->texture, quad, 1);
+}
+
+// Build the quad draw_image would draw, in window coordinates.
+void ng::Graphics::image_quad (Image* const image, const Rect2& src, const Box2& dest,
+double angle, int flip, SDL_Vertex* quad) const {
+	// Texture coordinates, offset into the atlas page, and swapped to flip.
+	double x = static_cast<double>(image->x) + src.x;
+	double y = static_cast<double>(image->y) + src.y;
+	float u0 = static_cast<float>(x / image->texture_w);
+	float v0 = static_cast<float>(y / image->texture_h);
+	float u1 = static_cast<float>((x + src.w) / image->texture_w);
+	float v1 = static_cast<float>((y + src.h) / image->texture_h);
+	if ((flip & ng::FlipX) != 0) {
+		float u = u0;
+		u0 = u1;
+		u1 = u;
+	}
+	if ((flip & ng::FlipY) != 0) {
+		float v = v0;
+		v0 = v1;
+		v1 = v;
+	}
 	
-	if (SDL_RenderCopyEx(this->renderer, image->texture, &src_sdl, &dest_sdl,
-	ng::degrees(angle), NULL, ng::sdl_flip(flip)) != 0) {
-		throw std::runtime_error(SDL_GetError());
+	// Corners around the center, in window coordinates, turned by angle.
+	double cx = ng::window_x(dest.x, this->rx);
+	double cy = ng::window_y(dest.y, this->ry);
+	double c = std::cos(angle);
+	double s = std::sin(angle);
+	double dx[4] = {-dest.rx, dest.rx, dest.rx, -dest.rx};
+	double dy[4] = {-dest.ry, -dest.ry, dest.ry, dest.ry};
+	float u[4] = {u0, u1, u1, u0};
+	float v[4] = {v0, v0, v1, v1};
+	SDL_Color color;
+	color.r = static_cast<Uint8>(image->color.r);
+	color.g = static_cast<Uint8>(image->color.g);
+	color.b = static_cast<Uint8>(image->color.b);
+	color.a = static_cast<Uint8>(image->color.a);
+	
+	for (int i=0; i < 4; i++) {
+		quad[i].position.x = static_cast<float>(cx + (dx[i] * c) - (dy[i] * s));
+		quad[i].position.y = static_cast<float>(cy + (dx[i] * s) + (dy[i] * c));
+		quad[i].color = color;
+		quad[i].tex_coord.x = u[i];
+		quad[i].tex_coord.y = v[i];
+	}
+}
+
+// Draw count quads of texture, from image_quad, as part of one batch.
+void ng::Graphics::draw_quads (SDL_Texture* texture, const SDL_Vertex* quads, int count) {
+	if (count <= 0) {
+		return;
+	}
+	if (this->deferred) {
+		RenderCommand command;
+		command.mode = ng::RenderImage;
+		command.texture = texture;
+		if (SDL_GetTextureBlendMode(texture, &command.blend) != 0) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		for (int i=0; i < count; i++) {
+			for (int j=0; j < 4; j++) {
+				command.quad[j] = quads[(i * 4) + j];
+			}
+			this->record(command);
+		}
+		return;
+	}
+	
+	if (this->batch.texture != texture || this->shapes.mode != 0) {
+		this->flush();
+		this->batch.texture = texture;
+	}
+	for (int i=0; i < count; i++) {
+		this->batch.add(quads + (i * 4));
 	}
 }
 
 // Draw shape.
 void ng::Graphics::draw_box (const Box2& dest, int draw) {
 	SDL_Rect dest_sdl = ng::sdl_rect(ng::window_rect(dest));
-	
-	switch (draw) {
-		case ng::DrawFill: {
-			if (SDL_RenderFillRect(this->renderer, &dest_sdl) != 0) {
-				throw std::runtime_error(SDL_GetError());
-			}
-			break;
-		} case ng::DrawFrame: default: {
-			if (SDL_RenderDrawRect(this->renderer, &dest_sdl) != 0) {
-				throw std::runtime_error(SDL_GetError());
-			}
-		}
+	if (this->deferred) {
+		RenderCommand command;
+		command.mode = ng::RenderBox;
+		command.draw = draw;
+		command.quad[0].position.x = static_cast<float>(dest_sdl.x);
+		command.quad[0].position.y = static_cast<float>(dest_sdl.y);
+		command.quad[2].position.x = static_cast<float>(dest_sdl.x + dest_sdl.w);
+		command.quad[2].position.y = static_cast<float>(dest_sdl.y + dest_sdl.h);
+		this->record(command);
+		return;
 	}
+	this->begin_shapes(ng::RenderBox, draw);
+	this->shapes.add_rect(dest_sdl);
 }
 
 void ng::Graphics::draw_line (const Vec2& p1, const Vec2& p2) {
@@ -382,19 +1347,91 @@ void ng::Graphics::draw_line (const Vec2& p1, const Vec2& p2) {
 	y1 = static_cast<int>(ng::window_y(p1.y, this->ry));
 	x2 = static_cast<int>(ng::window_x(p2.x, this->rx));
 	y2 = static_cast<int>(ng::window_y(p2.y, this->ry));
-
-	if (SDL_RenderDrawLine(this->renderer, x1, y1, x2, y2) != 0) {
-		throw std::runtime_error(SDL_GetError());
+	if (this->deferred) {
+		RenderCommand command;
+		command.mode = ng::RenderLine;
+		command.quad[0].position.x = static_cast<float>(x1);
+		command.quad[0].position.y = static_cast<float>(y1);
+		command.quad[1].position.x = static_cast<float>(x2);
+		command.quad[1].position.y = static_cast<float>(y2);
+		this->record(command);
+		return;
 	}
+	SDL_Point a;
+	a.x = x1;
+	a.y = y1;
+	SDL_Point b;
+	b.x = x2;
+	b.y = y2;
+	this->begin_shapes(ng::RenderLine, 0);
+	this->shapes.add_line(a, b);
 }
 
 void ng::Graphics::draw_point (const Vec2& p) {
 	int x, y;
 	x = static_cast<int>(ng::window_x(p.x, this->rx));
 	y = static_cast<int>(ng::window_y(p.y, this->ry));
+	if (this->deferred) {
+		RenderCommand command;
+		command.mode = ng::RenderPoint;
+		command.quad[0].position.x = static_cast<float>(x);
+		command.quad[0].position.y = static_cast<float>(y);
+		this->record(command);
+		return;
+	}
+	SDL_Point a;
+	a.x = x;
+	a.y = y;
+	this->begin_shapes(ng::RenderPoint, 0);
+	this->shapes.add_point(a);
+}
 
-	if (SDL_RenderDrawPoint(this->renderer, x, y) != 0) {
-		throw std::runtime_error(SDL_GetError());
+// Draw many shapes. Boxes and points are one render call each batch, and
+// lines are one per strip.
+void ng::Graphics::draw_boxes (const Box2* boxes, int count, int draw) {
+	if (this->deferred) {
+		for (int i=0; i < count; i++) {
+			this->draw_box(boxes[i], draw);
+		}
+		return;
+	}
+	this->begin_shapes(ng::RenderBox, draw);
+	for (int i=0; i < count; i++) {
+		this->shapes.add_rect(ng::sdl_rect(ng::window_rect(boxes[i], this->rx, this->ry)));
+	}
+}
+
+void ng::Graphics::draw_points (const Vec2* points, int count) {
+	if (this->deferred) {
+		for (int i=0; i < count; i++) {
+			this->draw_point(points[i]);
+		}
+		return;
+	}
+	this->begin_shapes(ng::RenderPoint, 0);
+	for (int i=0; i < count; i++) {
+		this->shapes.add_point(window_point(points[i], this->rx, this->ry));
+	}
+}
+
+// Draw connected lines through count points.
+// Each line starts where the last ended, so they share one strip.
+void ng::Graphics::draw_lines (const Vec2* points, int count) {
+	if (this->deferred) {
+		for (int i=1; i < count; i++) {
+			this->draw_line(points[i-1], points[i]);
+		}
+		return;
+	}
+	if (count < 2) {
+		return;
+	}
+	this->begin_shapes(ng::RenderLine, 0);
+	SDL_Point a = window_point(points[0], this->rx, this->ry);
+	for (int i=1; i < count; i++) {
+		SDL_Point b = window_point(points[i], this->rx, this->ry);
+		this->shapes.add_line(a, b);
+		a = b;
 	}
 }
 
@@ -20,6 +20,18 @@ namespace ng {
 		DrawFill = 1
 	};
 	
+	enum EnumGraphicsMode {
+		GraphicsWindow = 1, // window with accelerated renderer
+		GraphicsHeadless = 2 // no window, software renderer draws to surface
+	};
+	
+	enum EnumRender {
+		RenderImage = 1,
+		RenderBox = 2,
+		RenderLine = 3,
+		RenderPoint = 4
+	};
+	
 	// Switch between window and graphics coordinates.
 	// Window (0,0) is top-left corner, +x points right, and +y points down.
 	// Graphics (0,0) is center, +x points right, and +y points up.
@@ -59,28 +71,188 @@ namespace ng {
 		SDL_Texture* texture;
 		double w;
 		double h;
-		Color color;
+		Color color; // tint and alpha, given to each vertex when drawn
+		// In an atlas, image is the w*h area at (x, y) of a shared texture.
+		Atlas* atlas; // NULL if image owns its texture
+		int x;
+		int y;
+		double texture_w; // size of whole texture
+		double texture_h;
 		
 		Image ();
 		~Image ();
 		
 		void load (Graphics* const graphics, const char* file, const Color& key);
+		
+		// Make texture from a decoded surface, with its color key.
+		// Does not free surface.
+		void load (Graphics* const graphics, SDL_Surface* surface);
 		void set_color (const Color& color);
 		void set_alpha (const Color& color);
 	};
 	
+	// Packs many images into a few large textures (pages), so images drawn
+	// together share a texture and batch. Add images, then build once.
+	// Pages are packed with a skyline, tallest images first, with 1 pixel
+	// of padding so filtering does not bleed between images.
+	class Atlas {
+	public:
+		int page_w;
+		int page_h;
+		std::vector<SDL_Texture*> textures; // one per page, made by build
+		// Added images, kept after build so reset can let go of them, and their
+		// decoded surfaces, until build.
+		std::vector<Image*> images;
+		std::vector<SDL_Surface*> surfaces;
+		bool built;
+		
+		Atlas ();
+		~Atlas ();
+		
+		// Free every page, and start over with pages of w*h pixels.
+		// Images still on a page are left with no texture, so they draw nothing.
+		void reset (int page_w, int page_h);
+		
+		// Load a BMP file with color key, to be packed into image by build.
+		void add (Image* image, const char* file, const Color& key);
+		
+		// Take a decoded surface, with its color key, to be packed into image by
+		// build. Atlas frees surface.
+		void add (Image* image, SDL_Surface* surface);
+		
+		// Pack added images into pages, make a texture per page, and point each
+		// image at its area.
+		void build (Graphics* const graphics);
+		
+		// Internal. Called by image load and destructor.
+		// Forget a built image, so reset does not touch it.
+		void remove (Image* image);
+	};
+	
+	// Textured quads that share one texture, drawn with one SDL_RenderGeometry.
+	// Quads are in window coordinates, with their own color.
+	class SpriteBatch {
+	public:
+		SDL_Texture* texture; // texture of every quad, or NULL when empty
+		std::vector<SDL_Vertex> vertices; // 4 per quad, kept between flushes
+		std::vector<int> indices; // 6 per quad
+		
+		SpriteBatch ();
+		~SpriteBatch ();
+		
+		// Add quad with corners top-left, top-right, bottom-right, bottom-left.
+		void add (const SDL_Vertex* quad);
+		
+		// Draw quads, and empty batch. Returns false if there was nothing to draw.
+		bool flush (SDL_Renderer* renderer);
+	};
+	
+	// Shapes of one EnumRender mode, drawn with SDL_RenderDrawPoints,
+	// SDL_RenderDrawLines, SDL_RenderFillRects, or SDL_RenderDrawRects.
+	// Shapes are in window pixels, with the renderer's draw color.
+	class ShapeBatch {
+	public:
+		int mode; // EnumRender mode of every shape, or 0 when empty
+		int draw; // EnumDrawMode of every box
+		std::vector<SDL_Point> points; // points, or line strips end to end
+		std::vector<int> strips; // end of each line strip in points
+		std::vector<SDL_Rect> rects; // boxes
+		
+		ShapeBatch ();
+		~ShapeBatch ();
+		
+		// Add point.
+		void add_point (const SDL_Point& p);
+		
+		// Add line. A line starting where the last one ended joins its strip.
+		void add_line (const SDL_Point& p1, const SDL_Point& p2);
+		
+		// Add box.
+		void add_rect (const SDL_Rect& rect);
+		
+		// Draw shapes, one render call per strip or one for all points or boxes,
+		// and empty batch. Returns the number of render calls.
+		int flush (SDL_Renderer* renderer);
+	};
+	
+	// Draw recorded in deferred mode, with EnumRender mode, replayed by draw.
+	// Positions are in window coordinates.
+	class RenderCommand {
+	public:
+		int mode;
+		int layer;
+		uint32_t order; // recorded order, keeps sort stable
+		SDL_Texture* texture; // NULL for shapes
+		SDL_BlendMode blend;
+		SDL_Color color;
+		int draw; // EnumDrawMode, for boxes
+		// Image quad, or box corners in 0 and 2, or line ends in 0 and 1.
+		SDL_Vertex quad[4];
+		
+		RenderCommand ();
+		~RenderCommand ();
+	};
+	
+	// Renderer state saved by Graphics::begin_texture, put back by end_texture.
+	class RenderTarget {
+	public:
+		SDL_Texture* texture; // NULL for the window
+		double rx;
+		double ry;
+		bool deferred;
+		bool clipped;
+		SDL_Rect clip;
+		
+		RenderTarget ();
+		~RenderTarget ();
+	};
+	
 	class Graphics {
 	public:
-		SDL_Window* window;
+		int mode; // EnumGraphicsMode
+		SDL_Window* window; // NULL in headless mode
 		SDL_Renderer* renderer;
+		SDL_Surface* surface; // headless mode draws here, else NULL
 		double rx;
 		double ry;
 		Color color;
+		// Images drawn in a row with the same texture become one render call.
+		// Any other drawing flushes the batch first, so order is kept.
+		SpriteBatch batch;
+		ShapeBatch shapes; // lines, points, and boxes, between state changes
+		int draws; // render calls since last draw
+		int frame_draws; // render calls in last frame
+		// Deferred mode. Draws are recorded, then sorted by layer, texture, and
+		// blend, and replayed by draw, setting each renderer state only when it
+		// changes. Within a layer, draws may change order.
+		bool deferred;
+		int layer; // layer of following draws, lower draws first
+		std::vector<RenderCommand> commands; // memory kept between frames
+		// Retained mode. The window is kept in a target texture, only damaged
+		// parts are cleared and redrawn, clipped to the bounds of the damage, and
+		// draw copies the texture to the window.
+		bool retained;
+		SDL_Texture* target; // NULL until first clear in retained mode
+		int target_w;
+		int target_h;
+		bool damaged; // damage_rect needs redraw
+		SDL_Rect damage_rect; // bounds of damage, in window pixels
+		std::vector<RenderTarget> targets; // saved by begin_texture, innermost last
+		int resets; // times SDL dropped render targets, so canvas caches redraw
 		
 		Graphics ();
 		
+		// Open window and renderer, in window mode.
 		void open (const char* title, double rx, double ry);
+		
+		// Open with EnumGraphicsMode mode. Headless mode has no window, and draws
+		// with the software renderer into surface, for servers with no display or
+		// GPU. Set SDL_VIDEODRIVER=dummy there, so ng::init works.
+		void open (const char* title, double rx, double ry, int mode);
 		void close ();
+		
+		// Headless mode. Write surface, as drawn by the last draw, to a .bmp file.
+		void save (const char* file);
 		void set_color (const Color& color);
 		void set_alpha (const Color& color);
 		void set_window_dim (const Vec2& dim);
@@ -88,9 +260,72 @@ namespace ng {
 		Vec2 window_dim () const;
 		Vec2 dim () const;
 		
+		// In retained mode, clear only clears damage, and draws after it are
+		// clipped to damage.
 		void clear ();
 		void draw ();
 		
+		// Draw batched images and shapes now.
+		void flush ();
+		
+		// Internal. Called by shape draw functions.
+		// Flush batches that cannot take a shape of mode and draw.
+		void begin_shapes (int mode, int draw);
+		
+		// Record draws, and replay them sorted when drawn, instead of drawing now.
+		// Off by default. Turning it off replays what was recorded.
+		void set_deferred (bool deferred);
+		
+		// Set layer of following draws, in deferred mode.
+		void set_layer (int layer);
+		
+		// Keep the window between frames, and redraw only damage.
+		// Off by default. Turning it on damages the whole window.
+		void set_retained (bool retained);
+		
+		// Mark box to be redrawn by the next clear, in retained mode.
+		// When a sprite moves, damage where it was and where it is.
+		void damage (const Box2& box);
+		
+		// Mark whole window to be redrawn.
+		void damage ();
+		
+		// True if the next clear will redraw anything. If false, skip clear and
+		// drawing, and call draw to show the kept window.
+		// Always true when not in retained mode.
+		bool dirty () const;
+		
+		// Internal. Called by clear, in retained mode.
+		// Make target texture fit the window. A new texture is all damage.
+		void begin_target ();
+		
+		// Internal. Called by event::next, when SDL drops the contents of render
+		// targets (device lost, or minimized with Direct3D). Rebuilds the target
+		// texture, and counts resets so canvas caches redraw.
+		void reset_targets ();
+		
+		// Draw to texture as if it were box on the window, until end_texture.
+		// Texture is 2*box.rx by 2*box.ry pixels. Draws in between are not
+		// deferred. Pairs may nest.
+		void begin_texture (SDL_Texture* texture, const Box2& box);
+		
+		// Go back to drawing where begin_texture left off.
+		void end_texture ();
+		
+		// Internal. Called by draw and set_deferred.
+		// Sort and replay recorded draws, then forget them.
+		// Images go through the batch, so a run of one texture is one render call.
+		// Shapes set draw color and blend mode only when they change.
+		void replay ();
+		
+		// Internal. Called by draw_ functions, in deferred mode.
+		// Record draw with current layer. Shapes also take current color and blend.
+		void record (const RenderCommand& command);
+		
+		// Internal. Called by replay and clear.
+		// Set renderer draw color and blend mode to current color.
+		void restore ();
+		
 		// Draw a message box.
 		// Blocks execution of main thread until user clicks a button or closes the window.
 		void draw_errormsg (const std::string& title, const std::string& msg);
@@ -108,10 +343,25 @@ namespace ng {
 		void draw_image (Image* const image, const Rect2& src, const Box2& dest,
 			double angle, int flip);
 		
+		// Build the quad draw_image would draw, in window coordinates.
+		void image_quad (Image* const image, const Rect2& src, const Box2& dest,
+			double angle, int flip, SDL_Vertex* quad) const;
+		
+		// Draw count quads of texture, from image_quad, as part of one batch.
+		void draw_quads (SDL_Texture* texture, const SDL_Vertex* quads, int count);
+		
 		// Draw shape.
 		void draw_box (const Box2& box, int draw);
 		void draw_line (const Vec2& p1, const Vec2& p2);
 		void draw_point (const Vec2& p);
+		
+		// Draw many shapes. Boxes and points are one render call each batch, and
+		// lines are one per strip.
+		void draw_boxes (const Box2* boxes, int count, int draw);
+		void draw_points (const Vec2* points, int count);
+		
+		// Draw connected lines through count points.
+		void draw_lines (const Vec2* points, int count);
 	};
 
 }
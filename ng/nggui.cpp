@@ -3,6 +3,7 @@
 
 #include "nggui.h"
 #include "ngmath.h"
+#include <algorithm>
 
 /*
 ng::Text::Text () {
@@ -283,10 +284,124 @@ bool ng::Label::contains (const Vec2* p) const {
 	return this->rect.contains(p);
 }
 
+// Exact compares, to tell if a text run changed.
+static bool same (const ng::Vec2& a, const ng::Vec2& b) {
+	return a.x == b.x && a.y == b.y;
+}
+
+static bool same (const ng::Mat2& A, const ng::Mat2& B) {
+	return A.a == B.a && A.b == B.b && A.c == B.c && A.d == B.d;
+}
+
+static bool same (const ng::Box2& a, const ng::Box2& b) {
+	return a.x == b.x && a.y == b.y && a.rx == b.rx && a.ry == b.ry;
+}
+
+static bool same (const ng::Color& a, const ng::Color& b) {
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+ng::TextRun::TextRun () {
+	this->tileset = NULL;
+	this->valid = false;
+	this->image = NULL;
+	this->placed = false;
+	this->where_rx = 0.0;
+	this->where_ry = 0.0;
+}
+
+ng::TextRun::~TextRun () {}
+
+// Set what to draw. Only a change makes the run lay out again.
+void ng::TextRun::set (Tileset* tileset, const std::string& text, const Vec2& p,
+const Mat2& space) {
+	if (this->valid && this->tileset == tileset && this->text == text &&
+	same(this->p, p) && same(this->space, space)) {
+		return;
+	}
+	this->tileset = tileset;
+	this->text = text;
+	this->p = p;
+	this->space = space;
+	this->valid = false;
+}
+
+// Find glyph src and dest for text.
+// Each glyph is one cell of space, and a newline starts the next line.
+void ng::TextRun::layout () {
+	this->src.clear();
+	this->dest.clear();
+	this->valid = true;
+	this->placed = false;
+	this->image = this->tileset->image;
+	this->tile_p = this->tileset->p;
+	this->tile_space = this->tileset->space;
+	if (this->image == NULL) {
+		return;
+	}
+	
+	double tw = std::fabs(this->tile_space.a);
+	double th = std::fabs(this->tile_space.d);
+	int columns = 1;
+	if (tw > 0.0) {
+		columns = static_cast<int>((this->image->w - this->tile_p.x) / tw);
+	}
+	if (columns < 1) {
+		columns = 1;
+	}
+	
+	const Mat2& A = this->space;
+	double rx = std::fabs(A.a) * 0.5;
+	double ry = std::fabs(A.d) * 0.5;
+	double column = 0.0;
+	double line = 0.0;
+	double left = 0.0;
+	double right = 0.0;
+	double bottom = 0.0;
+	double top = 0.0;
+	for (size_t i=0; i < this->text.size(); i++) {
+		unsigned char ch = static_cast<unsigned char>(this->text[i]);
+		if (ch == '\n') {
+			column = 0.0;
+			line += 1.0;
+			continue;
+		}
+		
+		int tile = static_cast<int>(ch);
+		Rect2 s(this->tile_p.x + (tw * static_cast<double>(tile % columns)),
+		        this->tile_p.y + (th * static_cast<double>(tile / columns)), tw, th);
+		double x = column + 0.5;
+		double y = line + 0.5;
+		Box2 d(this->p.x + (A.a * x) + (A.b * y),
+		       this->p.y + (A.c * x) + (A.d * y), rx, ry);
+		
+		if (this->dest.empty()) {
+			left = d.x - d.rx;
+			right = d.x + d.rx;
+			bottom = d.y - d.ry;
+			top = d.y + d.ry;
+		} else {
+			left = std::min(left, d.x - d.rx);
+			right = std::max(right, d.x + d.rx);
+			bottom = std::min(bottom, d.y - d.ry);
+			top = std::max(top, d.y + d.ry);
+		}
+		this->src.push_back(s);
+		this->dest.push_back(d);
+		column += 1.0;
+	}
+	this->bounds.set((left + right) * 0.5, (bottom + top) * 0.5,
+		(right - left) * 0.5, (top - bottom) * 0.5);
+}
+
 ng::Canvas::Canvas () {
 	this->graphics = NULL;
 	this->parent = NULL;
 	this->root = false;
+	this->cached = false;
+	this->valid = false;
+	this->drawing = false;
+	this->resets = 0;
 }
 
 ng::Canvas::~Canvas () {}
@@ -349,6 +464,198 @@ void ng::Canvas::get_mouse (Vec2* const mouse) const {
 	this->space.relative(mouse);
 }
 
+// Given box on this canvas, find bounds of box on parent canvas, or on
+// graphics if root.
+// Canvas space turns and scales dest about the center of the canvas box.
+// The bounds of the turned box stay upright.
+ng::Box2 ng::Canvas::to_parent (const Box2& dest) const {
+	const Mat2& A = this->space;
+	Box2 d(this->box.x + (A.a * dest.x) + (A.b * dest.y),
+	       this->box.y + (A.c * dest.x) + (A.d * dest.y),
+	       (std::fabs(A.a) * dest.rx) + (std::fabs(A.b) * dest.ry),
+	       (std::fabs(A.c) * dest.rx) + (std::fabs(A.d) * dest.ry));
+	return d;
+}
+
+// Given box on this canvas, find bounds of box on graphics.
+ng::Box2 ng::Canvas::to_graphics (const Box2& dest) const {
+	Box2 d = this->to_parent(dest);
+	if (this->root) {
+		return d;
+	}
+	return this->parent->to_graphics(d);
+}
+
+// Cache canvas in a texture. Off by default.
+void ng::Canvas::set_cached (bool cached) {
+	this->cached = cached;
+	this->valid = false;
+	if (!cached && this->cache.texture != NULL) {
+		SDL_DestroyTexture(this->cache.texture);
+		this->cache.texture = NULL;
+	}
+}
+
+// Start drawing canvas contents. Returns false if a cached canvas is
+// still valid, so its contents need not be drawn. Call end either way.
+// An invalid cache is cleared to transparent, and draws go into it.
+bool ng::Canvas::begin () {
+	if (!this->cached) {
+		return true;
+	}
+	
+	// Canvas box on the window, which is the size of the cache in pixels.
+	Box2 dest = this->box;
+	if (!this->root) {
+		dest = this->parent->to_graphics(this->box);
+	}
+	int w = static_cast<int>(std::ceil(dest.rx * 2.0));
+	int h = static_cast<int>(std::ceil(dest.ry * 2.0));
+	if (w < 1 || h < 1) {
+		// Nothing to see.
+		return false;
+	}
+	// SDL dropped render targets since the cache was made, so make it again.
+	if (this->resets != this->graphics->resets && this->cache.texture != NULL) {
+		SDL_DestroyTexture(this->cache.texture);
+		this->cache.texture = NULL;
+	}
+	this->resets = this->graphics->resets;
+	bool fits = this->cache.texture != NULL &&
+		w == static_cast<int>(this->cache.texture_w) &&
+		h == static_cast<int>(this->cache.texture_h);
+	if (fits && this->valid) {
+		return false;
+	}
+	
+	if (!fits) {
+		if (this->cache.texture != NULL) {
+			SDL_DestroyTexture(this->cache.texture);
+		}
+		this->cache.texture = SDL_CreateTexture(this->graphics->renderer,
+			SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, w, h);
+		if (this->cache.texture == NULL) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		// Draws blend into the cache cleared to transparent, which leaves its
+		// color already multiplied by alpha, so composite it premultiplied.
+		// Renderers without custom blend modes (software) fall back to blend,
+		// which is only exact where the cache is opaque.
+		SDL_BlendMode premultiplied = SDL_ComposeCustomBlendMode(
+			SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+			SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+		if (SDL_SetTextureBlendMode(this->cache.texture, premultiplied) != 0 &&
+		SDL_SetTextureBlendMode(this->cache.texture, SDL_BLENDMODE_BLEND) != 0) {
+			throw std::runtime_error(SDL_GetError());
+		}
+		this->cache.w = static_cast<double>(w);
+		this->cache.h = static_cast<double>(h);
+		this->cache.texture_w = static_cast<double>(w);
+		this->cache.texture_h = static_cast<double>(h);
+	}
+	
+	this->graphics->begin_texture(this->cache.texture, dest);
+	if (SDL_SetRenderDrawColor(this->graphics->renderer, 0, 0, 0, 0) != 0 ||
+	SDL_RenderClear(this->graphics->renderer) != 0) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	this->graphics->restore();
+	this->drawing = true;
+	return true;
+}
+
+// Finish drawing canvas contents. A cached canvas draws its cache.
+void ng::Canvas::end () {
+	if (!this->cached) {
+		return;
+	}
+	if (this->drawing) {
+		this->graphics->end_texture();
+		this->drawing = false;
+		this->valid = true;
+	}
+	if (this->cache.texture == NULL) {
+		return;
+	}
+	
+	Rect2 src(0.0, 0.0, this->cache.w, this->cache.h);
+	if (this->root) {
+		this->graphics->draw_image(&this->cache, src, this->box);
+	} else {
+		this->parent->draw_image(&this->cache, src, this->box);
+	}
+}
+
+// Mark box on this canvas to be redrawn, in retained graphics mode or
+// in the cache.
+void ng::Canvas::damage (const Box2& dest) {
+	this->valid = false;
+	Box2 d = this->to_parent(dest);
+	
+	if (this->root) {
+		this->graphics->damage(d);
+	} else {
+		this->parent->damage(d);
+	}
+}
+
+// Mark whole canvas to be redrawn.
+void ng::Canvas::damage () {
+	this->valid = false;
+	if (this->root) {
+		this->graphics->damage(this->box);
+	} else {
+		this->parent->damage(this->box);
+	}
+}
+
+// Draw text run as one batch. Canvas space should not turn or mirror.
+// Glyphs keep their place in the run bounds, which are found on graphics
+// once per draw, instead of once per glyph.
+void ng::Canvas::draw_text (TextRun* const run) {
+	if (run->tileset == NULL) {
+		return;
+	}
+	const Tileset* tileset = run->tileset;
+	if (!run->valid || run->image != tileset->image ||
+	!same(run->tile_p, tileset->p) || !same(run->tile_space, tileset->space)) {
+		run->layout();
+	}
+	if (run->image == NULL || run->src.empty()) {
+		return;
+	}
+	
+	Box2 where = this->to_graphics(run->bounds);
+	if (!run->placed || !same(run->where, where) ||
+	run->where_rx != this->graphics->rx || run->where_ry != this->graphics->ry ||
+	!same(run->color, run->image->color)) {
+		double sx = 1.0;
+		double sy = 1.0;
+		if (run->bounds.rx > 0.0) {
+			sx = where.rx / run->bounds.rx;
+		}
+		if (run->bounds.ry > 0.0) {
+			sy = where.ry / run->bounds.ry;
+		}
+		run->quads.resize(run->src.size() * 4);
+		for (size_t i=0; i < run->src.size(); i++) {
+			const Box2& d = run->dest[i];
+			Box2 g(where.x + ((d.x - run->bounds.x) * sx),
+			       where.y + ((d.y - run->bounds.y) * sy), d.rx * sx, d.ry * sy);
+			this->graphics->image_quad(run->image, run->src[i], g, 0.0, ng::None,
+				&run->quads[i * 4]);
+		}
+		run->where = where;
+		run->where_rx = this->graphics->rx;
+		run->where_ry = this->graphics->ry;
+		run->color = run->image->color;
+		run->placed = true;
+	}
+	
+	this->graphics->draw_quads(run->image->texture, run->quads.data(),
+		static_cast<int>(run->src.size()));
+}
+
 // Graphics primitives
 void ng::Canvas::draw_image (Image* const image) {
 	Rect2 src(image->w * 0.5, image->h * 0.5, image->w, image->h);
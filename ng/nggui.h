@@ -102,6 +102,45 @@ namespace ng {
 		bool contains (const Vec2& p) const;
 	};
 	
+	// String laid out once into glyphs, then into quads on the window, drawn as
+	// one batch by Canvas::draw_text. Glyphs are rebuilt only when text,
+	// tileset, or space change, and quads only when glyphs, image color, or the
+	// canvas place on the window change.
+	// Tileset space is the tile size in image pixels, and tileset p the corner
+	// of the first tile. Glyph of char ch is tile ch, counting across then down.
+	class TextRun {
+	public:
+		std::string text;
+		Tileset* tileset;
+		Vec2 p; // top-left corner of first glyph, on canvas
+		Mat2 space; // next glyph along (a, c), next line along (b, d)
+		bool valid; // glyphs match text, tileset, p, and space
+		// Tileset as of the last layout.
+		Image* image;
+		Vec2 tile_p;
+		Mat2 tile_space;
+		Box2 bounds; // of all glyphs, on canvas
+		std::vector<Rect2> src; // per glyph, on tileset image
+		std::vector<Box2> dest; // per glyph, on canvas
+		bool placed; // quads match glyphs, and where
+		Box2 where; // bounds on graphics when quads were built
+		double where_rx; // graphics rx and ry when quads were built
+		double where_ry;
+		Color color; // image color when quads were built
+		std::vector<SDL_Vertex> quads; // 4 per glyph
+		
+		TextRun ();
+		~TextRun ();
+		
+		// Set what to draw. Only a change makes the run lay out again.
+		void set (Tileset* tileset, const std::string& text, const Vec2& p,
+			const Mat2& space);
+		
+		// Internal. Called by Canvas::draw_text.
+		// Find glyph src and dest for text.
+		void layout ();
+	};
+	
 	class Canvas {
 	public:
 		Graphics* graphics;
@@ -109,6 +148,15 @@ namespace ng {
 		bool root; // root draws to graphics. non-root draws to parent canvas.
 		Box2 box;
 		Mat2 space;
+		// Cached canvas draws into cache once, then draws cache to its parent
+		// as one image, until damaged. The cache is composited premultiplied, so
+		// translucent draws look the same as uncached. Without custom blend
+		// modes (software renderer), only opaque canvases look the same.
+		bool cached;
+		bool valid; // cache holds what the canvas would draw
+		bool drawing; // between begin and end, into cache
+		int resets; // graphics resets when cache was made, see Graphics::reset_targets
+		Image cache;
 		
 		Canvas ();
 		
@@ -118,9 +166,33 @@ namespace ng {
 		// Given event mouse point on graphics, find mouse point on this canvas.
 		void get_mouse (Vec2* const) const;
 		
+		// Given box on this canvas, find bounds of box on parent canvas, or on
+		// graphics if root.
+		Box2 to_parent (const Box2& dest) const;
+		
+		// Given box on this canvas, find bounds of box on graphics.
+		Box2 to_graphics (const Box2& dest) const;
+		
+		// Cache canvas in a texture. Off by default.
+		void set_cached (bool cached);
+		
+		// Start drawing canvas contents. Returns false if a cached canvas is
+		// still valid, so its contents need not be drawn. Call end either way.
+		bool begin ();
+		
+		// Finish drawing canvas contents. A cached canvas draws its cache.
+		void end ();
+		
 		// Draw canvas box.
 		void draw (int draw);
 		
+		// Mark box on this canvas to be redrawn, in retained graphics mode or
+		// in the cache.
+		void damage (const Box2& dest);
+		
+		// Mark whole canvas to be redrawn.
+		void damage ();
+		
 		// Graphics primitives
 		void draw_image (Image* const image);
 		void draw_image (Image* const image, const Box2& dest);
@@ -133,6 +205,8 @@ namespace ng {
 		
 		// Advanced graphics
 		void draw_text (Tileset* const, const std::string& text, const Mat2& dest_space);
+		// Draw text run as one batch. Canvas space should not turn or mirror.
+		void draw_text (TextRun* const run);
 		void draw_tile (Tileset* const, const Rect2& src, const Box2& dest);
 		
 		// Gui elements
@@ -0,0 +1,246 @@
+/* Copyright (C) 2022 - 2023 Nathanael Specht */
+
+#include "ngload.h"
+
+ng::Asset::Asset () {
+	this->mode = ng::None;
+	this->image = NULL;
+	this->surface = NULL;
+	this->clip = NULL;
+	SDL_AtomicSet(&this->state, ng::AssetQueued);
+}
+
+ng::Asset::~Asset () {
+	if (this->surface != NULL) {
+		SDL_FreeSurface(this->surface);
+	}
+}
+
+// True when the image or clip can be used.
+bool ng::Asset::ready () {
+	return SDL_AtomicGet(&this->state) == ng::AssetReady;
+}
+
+// True when loading failed. Error says why.
+bool ng::Asset::failed () {
+	return SDL_AtomicGet(&this->state) == ng::AssetFailed;
+}
+
+ng::Loader::Loader () {
+	this->graphics = NULL;
+	this->next = 0;
+	this->finished = 0;
+	this->lock = NULL;
+	this->wake = NULL;
+	this->running = false;
+}
+
+ng::Loader::~Loader () {
+	this->close();
+}
+
+// Worker thread.
+static int loader_thread (void* data) {
+	static_cast<ng::Loader*>(data)->work();
+	return 0;
+}
+
+// Start worker threads, making textures with graphics.
+void ng::Loader::open (Graphics* graphics, int workers) {
+	if (workers < 1) {
+		throw std::logic_error("loader needs at least 1 worker");
+	}
+	this->close();
+	this->graphics = graphics;
+	this->lock = SDL_CreateMutex();
+	this->wake = SDL_CreateCond();
+	if (this->lock == NULL || this->wake == NULL) {
+		std::runtime_error error(SDL_GetError());
+		this->close();
+		throw error;
+	}
+	this->running = true;
+	for (int i=0; i < workers; i++) {
+		SDL_Thread* thread = SDL_CreateThread(loader_thread, "ng::Loader", this);
+		if (thread == NULL) {
+			std::runtime_error error(SDL_GetError());
+			this->close();
+			throw error;
+		}
+		this->threads.push_back(thread);
+	}
+}
+
+// Stop and join worker threads, and free every asset handle.
+void ng::Loader::close () {
+	if (this->lock != NULL) {
+		SDL_LockMutex(this->lock);
+		this->running = false;
+		SDL_CondBroadcast(this->wake);
+		SDL_UnlockMutex(this->lock);
+	}
+	for (size_t i=0; i < this->threads.size(); i++) {
+		SDL_WaitThread(this->threads[i], NULL);
+	}
+	this->threads.clear();
+	for (size_t i=0; i < this->assets.size(); i++) {
+		delete this->assets[i];
+	}
+	this->assets.clear();
+	this->next = 0;
+	this->finished = 0;
+	if (this->wake != NULL) {
+		SDL_DestroyCond(this->wake);
+		this->wake = NULL;
+	}
+	if (this->lock != NULL) {
+		SDL_DestroyMutex(this->lock);
+		this->lock = NULL;
+	}
+}
+
+// Queue a BMP file to load into image, with color key.
+ng::Asset* ng::Loader::load (Image* image, const char* file, const Color& key) {
+	Asset* asset = new Asset();
+	asset->mode = ng::AssetImage;
+	asset->file = file;
+	asset->image = image;
+	asset->key = key;
+	return this->add(asset);
+}
+
+// Queue a WAV file, or a baked .npcm clip, to load into clip.
+ng::Asset* ng::Loader::load (Clip* clip, const char* file) {
+	Asset* asset = new Asset();
+	asset->mode = ng::AssetClip;
+	asset->file = file;
+	asset->clip = clip;
+	return this->add(asset);
+}
+
+// Add asset to the queue and wake a worker.
+ng::Asset* ng::Loader::add (Asset* asset) {
+	if (this->lock == NULL) {
+		delete asset;
+		throw std::logic_error("loader is not open");
+	}
+	SDL_LockMutex(this->lock);
+	this->assets.push_back(asset);
+	SDL_CondSignal(this->wake);
+	SDL_UnlockMutex(this->lock);
+	return asset;
+}
+
+// Decode asset on a worker thread. Images stop at a surface, since textures
+// belong to the render thread.
+static void decode_asset (ng::Asset* asset) {
+	if (asset->mode == ng::AssetClip) {
+		// Baked clips are mapped, with nothing to decode.
+		const std::string& f = asset->file;
+		if (f.size() > 5 && f.compare(f.size() - 5, 5, ".npcm") == 0) {
+			asset->clip->map(f.c_str());
+		} else {
+			asset->clip->load(f.c_str());
+		}
+		SDL_AtomicSet(&asset->state, ng::AssetReady);
+		return;
+	}
+	
+	SDL_Surface* surface = SDL_LoadBMP(asset->file.c_str());
+	if (surface == NULL) {
+		throw std::runtime_error(SDL_GetError());
+	}
+	if (SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format,
+	asset->key.r, asset->key.g, asset->key.b)) != 0) {
+		SDL_FreeSurface(surface);
+		throw std::runtime_error(SDL_GetError());
+	}
+	asset->surface = surface;
+	// SDL_AtomicSet is a full barrier, so surface is written before state.
+	SDL_AtomicSet(&asset->state, ng::AssetDecoded);
+}
+
+// Take queued assets and decode them, until close.
+void ng::Loader::work () {
+	while (true) {
+		SDL_LockMutex(this->lock);
+		while (this->running && this->next == this->assets.size()) {
+			SDL_CondWait(this->wake, this->lock);
+		}
+		if (!this->running) {
+			SDL_UnlockMutex(this->lock);
+			return;
+		}
+		Asset* asset = this->assets[this->next];
+		this->next++;
+		SDL_UnlockMutex(this->lock);
+		
+		try {
+			decode_asset(asset);
+		} catch (const std::exception& ex) {
+			asset->error = ex.what();
+			SDL_AtomicSet(&asset->state, ng::AssetFailed);
+		}
+	}
+}
+
+// Make textures for decoded images. Returns true when done.
+bool ng::Loader::finish () {
+	// Load and finish are both called on the render thread, so assets does
+	// not change during the loop. Workers only read it.
+	size_t count = this->assets.size();
+	size_t finished = 0;
+	for (size_t i=0; i < count; i++) {
+		Asset* asset = this->assets[i];
+		int state = SDL_AtomicGet(&asset->state);
+		if (state == ng::AssetDecoded) {
+			try {
+				asset->image->load(this->graphics, asset->surface);
+				SDL_AtomicSet(&asset->state, ng::AssetReady);
+			} catch (const std::exception& ex) {
+				asset->error = ex.what();
+				SDL_AtomicSet(&asset->state, ng::AssetFailed);
+			}
+			SDL_FreeSurface(asset->surface);
+			asset->surface = NULL;
+			state = SDL_AtomicGet(&asset->state);
+		}
+		if (state == ng::AssetReady || state == ng::AssetFailed) {
+			finished++;
+		}
+	}
+	this->finished = finished;
+	return finished == count;
+}
+
+// Assets ready or failed, over assets queued, [0, 1]. 1 if none queued.
+float ng::Loader::progress () {
+	if (this->assets.empty()) {
+		return 1.0f;
+	}
+	return static_cast<float>(this->finished) / static_cast<float>(this->assets.size());
+}
+
+// True when every asset is ready or failed.
+bool ng::Loader::done () {
+	return this->finished == this->assets.size();
+}
+
+// Call finish until done, without drawing.
+void ng::Loader::wait () {
+	while (!this->finish()) {
+		SDL_Delay(1);
+	}
+}
+
+// Throw runtime_error naming the first asset that failed, if any.
+void ng::Loader::check () {
+	for (size_t i=0; i < this->assets.size(); i++) {
+		if (this->assets[i]->failed()) {
+			throw std::runtime_error("can't load \"" + this->assets[i]->file + "\": " +
+				this->assets[i]->error);
+		}
+	}
+}
+
+
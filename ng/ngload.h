@@ -0,0 +1,117 @@
+/* Copyright (C) 2022 - 2023 Nathanael Specht */
+
+#ifndef NGLOAD_H
+#define NGLOAD_H
+
+#include "ngcore.h"
+#include "nggraphics.h"
+#include "ngaudio.h"
+
+namespace ng {
+	
+	enum EnumAsset {
+		AssetImage = 1, // BMP file, decoded on a worker, texture made by finish
+		AssetClip = 2 // WAV file decoded on a worker, or baked .npcm file mapped
+	};
+	
+	enum EnumAssetState {
+		AssetQueued = 1, // waiting for, or on, a worker
+		AssetDecoded = 2, // image surface waiting for finish, on render thread
+		AssetReady = 3,
+		AssetFailed = 4 // see error
+	};
+	
+	// Handle to an asset loading in the background, like a future.
+	// Owned by the loader. The image or clip must not be used until ready.
+	class Asset {
+	public:
+		int mode; // EnumAsset
+		std::string file;
+		Image* image;
+		Color key; // image color key
+		SDL_Surface* surface; // decoded image, until finish
+		Clip* clip;
+		SDL_atomic_t state; // EnumAssetState, written by worker and finish
+		std::string error; // set before state is AssetFailed
+		
+		Asset ();
+		~Asset ();
+		
+		// True when the image or clip can be used.
+		bool ready ();
+		
+		// True when loading failed. Error says why.
+		bool failed ();
+	};
+	
+	// Loads BMP and WAV files on worker threads.
+	// Textures can only be made on the render thread, so call finish every frame,
+	// and progress to draw a loading screen. Call load and finish on that thread.
+	// For example:
+	/*
+	loader.open(&graphics, 2);
+	loader.load(&image, "image.bmp", key);
+	loader.load(&clip, "clip.wav");
+	while (!loader.done()) {
+		loader.finish();
+		// draw loading screen with loader.progress()
+	}
+	loader.check();
+	loader.close();
+	*/
+	class Loader {
+	public:
+		Graphics* graphics;
+		std::vector<Asset*> assets; // in load order, guarded by lock
+		size_t next; // next asset for a worker, guarded by lock
+		size_t finished; // assets ready or failed, render thread only
+		std::vector<SDL_Thread*> threads;
+		SDL_mutex* lock;
+		SDL_cond* wake; // signaled when an asset is added, or on close
+		bool running; // guarded by lock
+		
+		Loader ();
+		~Loader ();
+		
+		// Start worker threads, making textures with graphics.
+		void open (Graphics* graphics, int workers);
+		
+		// Stop and join worker threads, and free every asset handle.
+		// Assets still queued are not loaded.
+		void close ();
+		
+		// Queue a BMP file to load into image, with color key.
+		Asset* load (Image* image, const char* file, const Color& key);
+		
+		// Queue a WAV file, or a baked .npcm clip, to load into clip.
+		Asset* load (Clip* clip, const char* file);
+		
+		// Render thread. Make textures for decoded images. Returns true when done.
+		bool finish ();
+		
+		// Assets ready or failed, over assets queued, [0, 1]. 1 if none queued.
+		float progress ();
+		
+		// True when every asset is ready or failed. Call finish first.
+		bool done ();
+		
+		// Render thread. Call finish until done, without drawing.
+		void wait ();
+		
+		// Throw runtime_error naming the first asset that failed, if any.
+		void check ();
+		
+		// Internal. Called by worker threads.
+		// Take queued assets and decode them, until close.
+		void work ();
+		
+		// Internal. Called by load.
+		// Add asset to the queue and wake a worker.
+		Asset* add (Asset* asset);
+	};
+	
+}
+
+#endif
+
+
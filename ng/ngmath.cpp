@@ -108,6 +108,18 @@ float ng::dB_volume (float x) {
 	return y;
 }
 
+// Given linear volume x [0, 1], produce amplitude gain y [0, 1].
+// Volume 1 is 0 dB, and volume 0 is silence, with a 60 dB taper between.
+// The mixer calls this once per buffer, then multiplies samples by y.
+float ng::volume_to_amp (float x) {
+	if (x <= 0.0f) {
+		return 0.0f;
+	} else if (x >= 1.0f) {
+		return 1.0f;
+	}
+	return ng::dB_to_amp((x - 1.0f) * 60.0f);
+}
+
 float ng::dB_silence () {
 	return -144.0f;
 }
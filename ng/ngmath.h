@@ -63,6 +63,11 @@ namespace ng {
 	// Multiply decibels by y to apply volume x.
 	float dB_volume (float);
 	
+	// Given linear volume x [0, 1], produce amplitude gain y [0, 1].
+	// Volume 1 is 0 dB, and volume 0 is silence, with a 60 dB taper between.
+	// The mixer calls this once per buffer, then multiplies samples by y.
+	float volume_to_amp (float);
+	
 	float dB_silence ();
 	
 	double radians (double degrees);